@@ -5,6 +5,8 @@
 #ifndef DIALOG_H
 #define DIALOG_H
 
+#include "journal.h"
+#include "notify.h"
 #include "threads.h"
 #include "utils.h"
 
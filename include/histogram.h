@@ -0,0 +1,61 @@
+/*  histogram.h
+    This file contains the latency histograms of the readers. They are HDR-style (log-linear):
+    every power of two of nanoseconds is split into HIST_SUB_BUCKETS equal buckets, so a recorded
+    value is known to within 1/HIST_SUB_BUCKETS of itself from 1 ns up to minutes, with a fixed,
+    small number of buckets and an O(1) record (a count-leading-zeros and an add).
+
+    The histograms belong to the process that records them, not to the shared memory segment:
+    recording stays a write to memory no other process touches, and the segment does not grow.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)                    // buckets per power of two (6% resolution)
+#define HIST_MAX_EXPONENT 40                                     // values from 2^40 ns (18 minutes) on share the last bucket
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (HIST_MAX_EXPONENT - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/*  One histogram. Only one thread records into it; the counters are atomic (with relaxed stores,
+    as in stats.h) so another thread may dump it at any time.
+    counts: number of values per bucket
+    total / max: number of values recorded and the largest one
+*/
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+} histogram_t;
+
+/*  The latency histograms of one reader in one dialog.
+    queue: from the moment a message was published (message_t.sent_ns) until the reader fetched it.
+    It covers the time the message waited in the ring, including the wakeup of a sleeping reader.
+    output: how long each write() of a batch of received messages to stdout took, i.e. output stalls.
+*/
+typedef struct {
+    histogram_t queue;
+    histogram_t output;
+} latency_t;
+
+/*  Records value (in ns) into h. Only one thread may record into a histogram.
+*/
+void hist_record(histogram_t *h, uint64_t value);
+
+/*  Adds the counts of from to into.
+*/
+void hist_merge(histogram_t *into, const histogram_t *from);
+
+/*  Returns the value below or at which the fraction p (0..1) of the recorded values lie, as the
+    highest value of its bucket, or 0 if nothing was recorded.
+*/
+uint64_t hist_percentile(const histogram_t *h, double p);
+
+/*  Prints one line for h: the label, the count and the p50 ... p99.99 and max values in microseconds.
+*/
+void hist_print(FILE *out, const char *label, const histogram_t *h);
+
+#endif
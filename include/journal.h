@@ -0,0 +1,122 @@
+/*  journal.h
+    This file contains the optional message journal of a dialog. The journal is an append-only file
+    (DIALOG_JOURNAL_DIR/dialog-<key>-<id>.journal) that every participant maps into its address space.
+    Messages are appended to it by the cleanup, right before their ring cells are reclaimed, so the
+    journal holds exactly the messages that have left the ring, in sequence order, and the ring holds
+    the rest. A process that joins late can replay the journal from any sequence number up to its
+    read cursor and then continue from the ring, and the messages survive the shared memory segment.
+
+    The cleanup does not touch the file: it copies the records into the staging area of the dialog in
+    the segment (journal_append), and a journal thread writes them into the mapping (journal_drain)
+    and syncs it periodically (journal_sync), so no send or receive waits for the file. ./dialog and
+    ./dialogbridge run a journal thread; processes using libdialog do not. Their records are written
+    out by the journal thread of another participant, or by the cleanup itself once the staging area
+    is full, and reach the disk on a FLUSH and when the last participant leaves.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "threads.h"
+#include "utils.h"
+
+#define JOURNAL_MAGIC 0x4c4e524au                                // "JRNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_DATA_OFFSET 4096                                 // the header has a page of its own
+
+#define DEFAULT_JOURNAL_SIZE (64u << 20)                         // bytes of records per journal file
+#define DEFAULT_JOURNAL_SYNC_MS 200
+
+/*  Header at the start of a journal file. It is shared through the file mapping, so the journal
+    keeps its state when the shared memory segment is gone.
+    magic / version: JOURNAL_MAGIC and JOURNAL_VERSION
+    capacity: bytes available for records after JOURNAL_DATA_OFFSET
+    end: bytes of records written so far. Records below end are complete and never change.
+    synced: bytes of records known to be on disk
+    next_seq: sequence number of the next message to append. A dialog that is activated with an
+    existing journal continues from it, so sequence numbers stay unique across restarts.
+    full: set once a record did not fit; nothing is appended after that.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    _Atomic uint64_t end;
+    _Atomic uint64_t synced;
+    _Atomic uint64_t next_seq;
+    _Atomic uint32_t full;
+} journal_header_t;
+
+/*  One journaled message. recipients is JOURNAL_TO_ALL for a message to everybody and 0 for a directed
+    one, whose recipients are not kept. The text follows the record and is padded to 8 bytes.
+*/
+typedef struct {
+    uint64_t seq;
+    uint32_t length;
+    uint16_t sender_slot;
+    uint16_t reserved;
+    int32_t sender_pid;
+    uint32_t recipients;
+} journal_record_t;
+
+#define JOURNAL_TO_ALL UINT32_MAX
+
+_Static_assert(sizeof(journal_record_t) == 24, "journal records are 8-byte aligned");
+
+/*  Creates (or reopens) the journal of the dialog in dir and enables journaling for it. Should be
+    called with the dialog_lock held, when the dialog is activated. If the journal already holds
+    messages and the dialog has never been used in this segment, the sequence numbers of the dialog
+    continue after the last journaled one. It returns 0 on success or -1 (journaling stays off).
+*/
+int journal_create(dialog_t *dialog, key_t shm_key, const char *dir, uint64_t size, uint32_t sync_ms);
+
+/*  Maps the journal of the dialog into this process, if the dialog has one and it is not mapped yet.
+    The append path maps it on its own when needed; calling it early keeps file I/O off that path.
+    It returns 0 if the journal is mapped, -1 otherwise.
+*/
+int journal_open(dialog_t *dialog);
+
+/*  Stages the message with sequence number seq, which is in cell m of the ring, for the journal.
+    Only the holder of the reclaiming flag of the dialog may call it, which makes it the only producer.
+    Fragments of streams (message_send_stream) are left out: the journal keeps the conversation, and a
+    record has no room for the place of a fragment in its stream. If the staging area is full it
+    writes it out itself; it returns 0, or -1 if there is still no room (the cell must not be
+    reclaimed yet).
+*/
+int journal_append(dialog_t *dialog, const message_t *m, uint64_t seq);
+
+/*  Writes the staged records of the dialog into its journal, in order, and frees their room. One
+    process drains a dialog at a time; if another one does, it returns at once, or waits for it if
+    wait is set.
+*/
+void journal_drain(dialog_t *dialog, int wait);
+
+/*  Returns the position of the first journaled message with a sequence number of at least seq,
+    for journal_read. It takes no lock.
+*/
+uint64_t journal_seek(dialog_t *dialog, uint64_t seq);
+
+/*  Copies the next journaled message for everybody at or after *pos into out and advances *pos past it,
+    if there is one with a sequence number below to_seq. Directed messages are passed over: their
+    recipients were the participants of that time. It returns 1 if a message was copied, 0 at the end.
+    It takes no lock.
+*/
+int journal_read(dialog_t *dialog, uint64_t *pos, uint64_t to_seq, received_message_t *out);
+
+/*  Drains the staged records and writes the journaled records that are not on disk yet to disk (msync).
+*/
+void journal_sync(dialog_t *dialog);
+
+/*  Called by the last participant leaving the dialog (my_slot is the slot it just left), with the
+    dialog_lock held: journals the messages still in the ring, syncs the journal and turns journaling
+    off until the next activation.
+*/
+void journal_close_dialog(dialog_t *dialog, int my_slot);
+
+/*  Body of the thread that drains the staged records of the dialogs of the process whenever a staging
+    area is half full, and syncs their journals every journal_sync_ms milliseconds (the shortest one
+    of them), until the terminate flag is raised. arg is the thread_args_t of the process.
+*/
+void* journal_thread(void *arg);
+
+#endif
@@ -0,0 +1,202 @@
+/*  libdialog.h
+    This file contains the interface of libdialog (libdialog.a / libdialog.so), which lets a program
+    take part in dialogs without the reader and writer threads of ./dialog and without any output.
+    A program opens the shared memory segment once, joins one or more dialogs and then sends and
+    receives messages itself. It uses the same segment, configuration (DIALOG_* variables) and
+    protocol as ./dialog, so both can take part in the same dialogs.
+
+    Receiving is zero-copy: dialog_receive hands out a read-only view of the message in shared
+    memory, which stays valid until the program acknowledges it with dialog_ack. Until then the
+    message is not reclaimed, just as an unread message is not, so views should be acknowledged
+    soon; under the block policy a view that is never acknowledged eventually stops the senders.
+
+    Payloads larger than the message size of the segment are sent as streams: dialog_send_stream cuts
+    them into fragments that carry their place in the payload, and a receiver puts every fragment
+    straight where it belongs, in a buffer or in a file it maps, with a dialog_stream_t.
+
+    Terminating, flushing and pausing a dialog are control events (dialog_control), which do not go
+    through the messages: they reach every participant right away, even when the dialog is full, and
+    dialog_receive hands them out before the messages. Joins and leaves are reported the same way.
+
+    The library runs no journal thread. Messages of a journaled dialog are staged in the segment and
+    written to its journal by the journal thread of a ./dialog or ./dialogbridge in the dialog, by the
+    cleanup once the staging area is full, on DIALOG_CONTROL_FLUSH and when the last participant
+    leaves; only the last two sync the journal to disk.
+
+    Like ./dialog, a process has one segment at a time, so there is one open handle per process.
+    A handle may be used by one thread at a time. The functions return -1 and set errno on failure;
+    a configuration or segment that is not usable at all is also reported on stderr, as ./dialog
+    does, but the process goes on.
+*/
+
+#ifndef LIBDIALOG_H
+#define LIBDIALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DIALOG_MAX_PARTICIPANTS 1024                             // participant slots a dialog can have at most
+
+/*  Kinds of control events, see dialog_control and dialog_view_t.control.
+*/
+#define DIALOG_CONTROL_TERMINATE 1                               // the dialog ends; leave it once the messages before are in
+#define DIALOG_CONTROL_FLUSH 2                                   // write out what was received so far
+#define DIALOG_CONTROL_PAUSE 3                                   // no messages are received until the resume
+#define DIALOG_CONTROL_RESUME 4
+#define DIALOG_CONTROL_JOIN 5                                    // sender_slot / sender_pid joined the dialog
+#define DIALOG_CONTROL_LEAVE 6                                   // or left it
+
+typedef struct dialog_handle dialog_handle_t;
+
+/*  The recipients of a message: slot s is bit s % 64 of words[s / 64]. Senders that pass NULL
+    instead send to everybody.
+*/
+typedef struct {
+    uint64_t words[DIALOG_MAX_PARTICIPANTS / 64];
+} dialog_recipients_t;
+
+static inline void dialog_recipients_add(dialog_recipients_t *recipients, int slot) {
+    recipients->words[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+/*  A message received with dialog_receive.
+    data / length: the text of the message in shared memory. It is not NUL-terminated, must not be
+    written to and stays valid until the view (or a later one of the same dialog) is acknowledged.
+    dialog_id: the dialog it was sent to
+    sender_slot / sender_pid: the slot of the sender in the dialog and its process
+    seq: the sequence number of the message inside its dialog
+    sent_ns: when it was published, in CLOCK_MONOTONIC nanoseconds
+    stream_id / stream_offset / stream_length: for a fragment of a stream (dialog_send_stream), the
+    number of the stream among those of its sender, where data goes in the payload and the length of
+    the whole payload. stream_id is 0 for an ordinary message.
+    control: 0 for a message. For a control event, its kind (DIALOG_CONTROL_*); data is NULL, length 0,
+    sender_slot / sender_pid the participant that posted it (or joined or left) and seq the sequence
+    number of the first message sent after it, so the messages with a lower seq were sent before it.
+*/
+typedef struct {
+    const char *data;
+    uint32_t length;
+    int dialog_id;
+    int sender_slot;
+    pid_t sender_pid;
+    uint64_t seq;
+    uint64_t sent_ns;
+    uint32_t stream_id;
+    uint64_t stream_offset;
+    uint64_t stream_length;
+    int control;
+} dialog_view_t;
+
+/*  A stream being received, see dialog_stream_begin.
+    dialog_id / sender_pid / stream_id: which stream it is
+    length: the length of the whole payload
+    received: the bytes of it received so far; the payload is complete when received == length
+    buffer: where the payload is put, the caller's buffer or the mapping of the output file
+    fd / mapped: the output file and the size of its mapping, or -1 and 0 for a caller's buffer
+*/
+typedef struct {
+    int dialog_id;
+    pid_t sender_pid;
+    uint32_t stream_id;
+    uint64_t length;
+    uint64_t received;
+    char *buffer;
+    int fd;
+    size_t mapped;
+} dialog_stream_t;
+
+/*  Attaches the shared memory segment of DIALOG_SHM_KEY, creating it for the DIALOG_* configuration
+    if needed. It returns the handle, or NULL with errno EBUSY (this process has one open already),
+    EINVAL (a DIALOG_* variable is invalid), EPROTO (the segment has the layout of another build, or
+    is too small for the configuration) or that of shmget or shmat (e.g. EACCES, ENOMEM).
+*/
+dialog_handle_t* dialog_open(void);
+
+/*  Joins the dialog with the given id (at most 64 per handle), activating it if needed. The first
+    message received is the oldest one still kept in the dialog. It returns the slot of this process
+    in the dialog, or -1 with errno EINVAL (no such dialog), EEXIST (joined already), E2BIG (too many
+    dialogs) or ENOSPC (the dialog is full). If the segment was removed since dialog_open, because every
+    other process left, a new one is attached first, which may fail as dialog_open does.
+*/
+int dialog_join(dialog_handle_t *handle, int dialog_id);
+
+/*  Sends length bytes at data to the joined dialog dialog_id, for the slots in recipients (NULL for
+    everybody; slots the dialog does not have are ignored). It does not wait: it returns 0 if the message was published
+    or -1 with errno ENOENT (not joined), EMSGSIZE (empty, longer than the message size of the
+    segment or too big for its arena) or EAGAIN (the dialog is full; try again later).
+*/
+int dialog_send(dialog_handle_t *handle, int dialog_id, const void *data, size_t length,
+                const dialog_recipients_t *recipients);
+
+/*  Sends the length bytes at data to the joined dialog dialog_id as a stream, for the slots in
+    recipients (NULL for everybody), except the slot of this process (it could not read the stream
+    while sending it).
+    The payload is cut into fragments of the message size of the segment. At most DIALOG_STREAM_WINDOW
+    of them (by default a quarter of the ring and of the arena) are in the dialog at once: the call
+    waits for the receivers to acknowledge the oldest ones before it sends more, so a large stream
+    leaves room for the other senders. It returns 0 once the whole payload is sent, or -1 with errno
+    ENOENT (not joined), EMSGSIZE (length is 0) or ETIMEDOUT (the dialog stayed full for longer than
+    its block timeout; the rest of the stream is not sent).
+*/
+int dialog_send_stream(dialog_handle_t *handle, int dialog_id, const void *data, size_t length,
+                       const dialog_recipients_t *recipients);
+
+/*  Posts a control event (DIALOG_CONTROL_TERMINATE, _FLUSH, _PAUSE or _RESUME) to the joined dialog
+    dialog_id, for every participant, this process included. A terminated dialog stays terminated until
+    its last participant has left. It returns 0, or -1 with errno ENOENT (not joined) or EINVAL (kind).
+*/
+int dialog_control(dialog_handle_t *handle, int dialog_id, int kind);
+
+/*  Receives the next message from any of the joined dialogs into view, without copying it. If block
+    is set it waits until there is one; otherwise it returns at once. It returns 1 if view was filled,
+    0 if there was no message (only without block) or -1 with errno ENOENT if no dialog is joined.
+    Several views may be held at once; every call returns a newer message. Control events come before
+    the messages of their dialog, and a paused dialog hands out control events only.
+*/
+int dialog_receive(dialog_handle_t *handle, dialog_view_t *view, int block);
+
+/*  Acknowledges view, and with it every earlier view of the same dialog: their messages may now be
+    reclaimed and their data must no longer be used. Acknowledging a control event does nothing. It returns 0, or -1 with errno ESTALE if the
+    flow-control policy of the dialog (drop-oldest or skip-lagging) reclaimed the message before it
+    was acknowledged, so the data read from the view may have been overwritten meanwhile.
+*/
+int dialog_ack(dialog_handle_t *handle, const dialog_view_t *view);
+
+/*  Starts receiving the stream whose first fragment is view (stream_offset 0) into buffer, which must
+    have room for view->stream_length bytes, and copies that fragment into it. The following fragments
+    are added with dialog_stream_add. It returns 0, or -1 with errno EINVAL (view is not the first
+    fragment of a stream) or EMSGSIZE (capacity is too small).
+*/
+int dialog_stream_begin(dialog_stream_t *stream, const dialog_view_t *view, void *buffer, size_t capacity);
+
+/*  Like dialog_stream_begin, but the payload goes into the file at path, which is created (or
+    truncated) with the length of the payload and mapped, so every fragment is copied straight into
+    the page cache. It returns 0, or -1 with errno EINVAL or the errno of open, ftruncate or mmap.
+*/
+int dialog_stream_begin_file(dialog_stream_t *stream, const dialog_view_t *view, const char *path);
+
+/*  Copies view into its place in the payload if it is the next fragment of stream. It returns 1 if it
+    was, 0 if view belongs to another stream or is an ordinary message, and -1 with errno EIO if it is
+    a later fragment of this stream: the fragments in between were reclaimed before they were read
+    (drop-oldest or skip-lagging policy), so the payload can not be completed. The view still has to be
+    acknowledged with dialog_ack, which may be done right after this call.
+*/
+int dialog_stream_add(dialog_stream_t *stream, const dialog_view_t *view);
+
+/*  Finishes stream: the output file of dialog_stream_begin_file is unmapped and closed. It returns 0 if
+    the whole payload was received, or -1 with errno EIO if it was not.
+*/
+int dialog_stream_end(dialog_stream_t *stream);
+
+/*  Leaves the joined dialog dialog_id; views of it must not be used anymore. It returns 0 or -1 with
+    errno ENOENT.
+*/
+int dialog_leave(dialog_handle_t *handle, int dialog_id);
+
+/*  Leaves every joined dialog, detaches the segment (removing it if this was its last process) and
+    frees the handle.
+*/
+void dialog_close(dialog_handle_t *handle);
+
+#endif
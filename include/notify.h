@@ -0,0 +1,60 @@
+/*  notify.h
+    This file contains the wakeup mechanism of the dialogs. Instead of one semaphore per
+    participant slot, every dialog has a single futex word in shared memory. Senders bump it
+    after publishing messages and only enter the kernel if some reader is actually asleep,
+    while readers spin for a short while before they go to sleep on it.
+*/
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include "threads.h"
+#include "utils.h"
+
+/*  Upper bound for the number of spin iterations a reader does before sleeping. The actual
+    budget of each reader adapts between 0 and this value (see dialog_wait).
+*/
+#define MAX_SPIN_ITERATIONS 4096
+
+/*  Wakes the readers of the dialog after one or more messages have been published.
+    Any number of calls between two wakeups of a reader are coalesced into one wakeup,
+    and no system call is made if no reader is sleeping.
+*/
+void dialog_notify(dialog_t *dialog);
+
+/*  Blocks until the given slot has an unread message in the dialog, or until dialog_notify
+    has been called after this function was entered. It first spins for at most *spin_budget
+    iterations and then sleeps on the futex word of the dialog. The budget belongs to the caller
+    and is adapted on every call: it grows when spinning found a message and shrinks when the
+    reader had to sleep anyway. On single-CPU machines the reader never spins.
+*/
+void dialog_wait(dialog_t *dialog, int my_slot, int *spin_budget);
+
+/*  Like dialog_wait, but for a process that follows several dialogs: blocks until one of the active
+    members has an unread message or has been notified. After spinning it registers as a sleeper in
+    every one of these dialogs and sleeps on all their futex words at once (futex_waitv), so a sender
+    of any of them wakes it with its usual dialog_notify. On kernels without futex_waitv (before 5.16)
+    it sleeps on one word at a time, in slices of WAIT_ANY_SLICE_MS.
+*/
+void dialog_wait_any(membership_t *members, int count, int *spin_budget);
+
+#define WAIT_ANY_SLICE_MS 5
+
+/*  Wakes the senders that wait for room in the dialog. Called by the cleanup after it freed cells;
+    like dialog_notify it makes no system call if nobody waits.
+*/
+void dialog_notify_space(dialog_t *dialog);
+
+/*  Sleeps until dialog_notify_space is called or timeout_ms milliseconds pass. seen is the value of
+    space_word that the caller read before it found the dialog full, so a notification that comes in
+    between is not missed. It returns at once if space_word has changed since.
+*/
+void dialog_wait_space(dialog_t *dialog, uint32_t seen, int timeout_ms);
+
+/*  The same pair for the journal threads (journal.h): the cleanup wakes them when the journal staging
+    area of the dialog gets half full, and they sleep until then or for timeout_ms milliseconds.
+*/
+void dialog_notify_journal(dialog_t *dialog);
+void dialog_wait_journal(dialog_t *dialog, uint32_t seen, int timeout_ms);
+
+#endif
@@ -0,0 +1,56 @@
+/*  slab.h
+    This file contains the allocator of the message payloads. Every dialog owns an arena of
+    arena_size bytes inside the shared memory, and payloads are carved out of it in
+    power-of-two size classes (16 bytes up to SLAB_MAX_BLOCK). Blocks are named by their
+    offset inside the arena, never by a pointer, so they mean the same thing in every process.
+    Allocation and release are lock-free: every class keeps a free list whose head is updated
+    with a compare-and-swap.
+
+    Freed blocks stay in the list of their class. Only when an allocation finds no block big
+    enough are the free blocks of all classes merged with their free neighbours (slab_alloc), so
+    an arena that small messages have carved up still has room for a large one once they are freed.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SLAB_MIN_BLOCK 16
+#define SLAB_CLASSES 13                                          // 16, 32, ..., 64 KiB
+#define SLAB_MAX_BLOCK (SLAB_MIN_BLOCK << (SLAB_CLASSES - 1))
+
+/*  The slab_t struct is the bookkeeping of one arena:
+    free_head: one free list per size class. The low 32 bits hold (offset + 1) of the first free
+    block, 0 meaning empty; the high 32 bits are a tag bumped on every change, so that a
+    compare-and-swap cannot succeed on a head that was popped and pushed back in the meantime (ABA).
+    The offset of the next free block is stored in the first 4 bytes of each free block.
+    bump: number of arena bytes handed out to the size classes so far. Fresh blocks are carved at
+    this offset when a class has nothing free.
+    arena_size: size of the arena in bytes. It is set once, when the segment is created.
+*/
+typedef struct {
+    _Atomic uint64_t free_head[SLAB_CLASSES];
+    _Atomic uint32_t bump;
+    uint32_t arena_size;
+} slab_t;
+
+/*  Allocates a block that can hold len bytes (1 <= len <= SLAB_MAX_BLOCK) and stores its
+    arena offset in *out_off. When the class of len has no free block, a fresh one is carved from
+    the unused part of the arena, or a free block of a bigger class is split. If that fails too, the
+    free blocks are merged and it tries once more. The merging takes the free lists for a moment, so
+    a concurrent allocation may fail meanwhile, and it needs a bitmap of arena_size / 128 bytes in
+    the memory of the process. It returns 0 on success or -1 if the arena has no room for the block.
+*/
+int slab_alloc(slab_t *slab, char *arena, uint32_t len, uint32_t *out_off);
+
+/*  Returns the block at offset off, that was allocated for len bytes, to its free list.
+*/
+void slab_free(slab_t *slab, char *arena, uint32_t off, uint32_t len);
+
+/*  Returns the size of the block that slab_alloc hands out for len bytes.
+*/
+uint32_t slab_block_size(uint32_t len);
+
+#endif
@@ -0,0 +1,74 @@
+/*  stats.h
+    This file contains the statistics counters that are kept inside the shared memory segment,
+    next to the state they describe, so that ./dialogstat can watch a running system without
+    stopping or slowing it. The counters only ever grow; rates are computed by the reader of the
+    counters from two samples.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*  Counters of one participant slot. Every counter has a single writer: the sending side of the
+    slot writes the sent_* and full counters, the reading side the received_* and sleeps counters,
+    and the process that holds the reclaiming flag of the dialog the skipped counter.
+    That is why they are updated with a plain relaxed store instead of a locked read-modify-write,
+    and why every slot has its own cache lines, one for the sending side and one for the reading side,
+    so neither slots nor the two threads of one process bounce each other's counters.
+    sent / sent_bytes: messages published by this slot and their total length
+    full: sends that found the dialog full (no ring cell or no payload space), retries included
+    timed_out: messages this slot gave up on, because the dialog stayed full past the block timeout
+    received / received_bytes: messages this slot fetched and their total length
+    sleeps: times the reader of this slot went to sleep on the futex of the dialog
+    skipped: messages addressed to this slot that were reclaimed before it read them
+    (drop-oldest or skip-lagging policy)
+*/
+typedef struct {
+    _Alignas(64) _Atomic uint64_t sent;
+    _Atomic uint64_t sent_bytes;
+    _Atomic uint64_t full;
+    _Atomic uint64_t timed_out;
+    _Alignas(64) _Atomic uint64_t received;
+    _Atomic uint64_t received_bytes;
+    _Atomic uint64_t sleeps;
+    _Atomic uint64_t skipped;
+} slot_stats_t;
+
+/*  Counters of an inter-process lock (the global mutex or a dialog_lock). They are updated by the
+    process that has just acquired the lock, so the lock itself serializes the writers.
+    acquired: number of acquisitions
+    contended: acquisitions that found the lock taken and had to wait
+    wait_ns: total time spent waiting for the lock
+    recovered: acquisitions that took the lock over from a process that died holding it
+*/
+typedef struct {
+    _Atomic uint64_t acquired;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t recovered;
+} lock_stats_t;
+
+/*  Counters of one dialog.
+    wakeups: FUTEX_WAKE system calls made by dialog_notify. Every sender of the dialog writes it, but
+    only right after a system call, so the atomic increment costs nothing noticeable.
+    dropped: messages reclaimed before all their recipients had read them. Only the process that holds the
+    reclaiming flag of the dialog writes it.
+    reaped: participants removed because their process had died, written under the dialog_lock
+    lock: the counters of the dialog_lock
+*/
+typedef struct {
+    _Alignas(64) _Atomic uint64_t wakeups;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t reaped;
+    lock_stats_t lock;
+} dialog_stats_t;
+
+/*  Adds n to a counter that has a single writer.
+*/
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#endif
@@ -11,44 +11,243 @@
 #include <pthread.h>
 #include <signal.h>
 
+#include "histogram.h"
 #include "utils.h"
 
+/*  One dialog that a process takes part in. A process may join several dialogs (./dialog 3 7 12);
+    then its single reader thread follows all of them.
+    dialog / dialog_id / my_slot: the dialog, its id and the slot of this process in it
+    active: 1 until the reader has received everything sent before the dialog was terminated
+    (CONTROL_TERMINATE); it is then no longer followed
+    zero_copy / view_seq: set by the library (libdialog.h), which reads with message_peek; view_seq
+    is its cursor, so waiting looks for messages from there on instead of from the read cursor
+    latency: the latency histograms of this reader in the dialog, or NULL
+*/
+typedef struct {
+    dialog_t *dialog;
+    int dialog_id;
+    int my_slot;
+    volatile sig_atomic_t active;
+    int zero_copy;
+    uint64_t view_seq;
+    latency_t *latency;
+} membership_t;
+
 /*  The thread_args_t struct is used in order to bundle all the arguments needed 
     for the threads together, as the pthreads fucntion accepts only once void* argument.
     shared_mem: pointer to the global shared memory segment
-    dialog: pointer to the dialog this process participates in
+    dialog: pointer to the first dialog this process participates in
     dialog_id: id of the dialog
     my_slot: the slot index that is assigned to this process
+    members / member_count: every dialog this process participates in, the first one included
     smd_id: shared memory id (it is used for cleanup)
     terminate_flag: signal-sage flag used to request the termination of the thread. More on that below.
+    wake_fd: a pipe; the reader writes to wake_fd[1] when it requests termination, so that the writer,
+    which sleeps in poll() on stdin and wake_fd[0], notices it at once.
 */
 typedef struct {
     shared_memory_t *shared_mem;
     dialog_t *dialog;
     int dialog_id;
     int my_slot;
+    membership_t *members;
+    int member_count;
     int shm_id;
     volatile sig_atomic_t *terminate_flag;
+    int wake_fd[2];
 } thread_args_t;
 
-/*  Waits for new messages addressed to this slot, prints/processes
-    these messages until termination is requested
+/*  Maximum number of messages that message_send_batch publishes in one call.
+*/
+#define MAX_SEND_BATCH 256
+
+/*  A message copied out of a dialog by message_fetch. Unlike message_t it owns its text,
+    which is NUL-terminated, so it stays valid after the message is reclaimed in shared memory.
+    seq: the sequence number of the message inside its dialog
+    sent_ns: when it was published (CLOCK_MONOTONIC)
+    length: the length of text without the terminating NUL
+    stream_id / stream_offset / stream_length: as in message_t; stream_id is 0 unless the message is
+    a fragment of a stream (see message_send_stream)
+*/
+typedef struct {
+    uint64_t seq;
+    uint64_t sent_ns;
+    int dialog_id;
+    int sender_slot;
+    pid_t sender_pid;
+    uint32_t length;
+    uint32_t stream_id;
+    uint64_t stream_offset;
+    uint64_t stream_length;
+    char text[MAX_MSG_SIZE + 1];
+} received_message_t;
+
+/*  Waits for new messages addressed to this process in any of its dialogs, prints/processes
+    these messages until termination is requested or every dialog was terminated. Control events
+    are looked at before the messages: joins, leaves, pauses and resumes are reported on stderr.
 */
 void* reader_thread(void* arg);
 
-/*  Reads user input and sends messages to teh dialog until termination is requested
+/*  Reads user input and sends messages to teh dialog until termination is requested. With several
+    dialogs, "#<dialog_ID> text" sends text to that dialog and a line "#<dialog_ID>" alone makes it the
+    dialog of the following lines; the first dialog is the default. The lines TERMINATE, FLUSH, PAUSE
+    and RESUME are not sent as messages but posted as control events (message_control).
 */
 void* writer_thread(void* arg);
 
-/*  Sends a message to the given dialog. It returns 0 on success or a negative
-    value if the message cannot be sent.
+/*  Sends a message to the given dialog. The text is copied into a slab block of the dialog, so
+    it may be up to dialog->max_msg_size bytes long. It returns 0 on success or a non-zero value if the
+    text is empty or too long, or if the dialog is full (no ring cell or no payload space left).
 */
 int message_send(dialog_t *dialog, int my_slot, const char *text);
 
-/*  Receives the next unread message for the given slot. It returns 0 if 
-    a message is received or a negative value if no message is available.
+/*  Sends a message like message_send, but only to the slots in recipients (NULL for everybody). The
+    other readers skip it without copying its text, and it is reclaimed as soon as its recipients have
+    read it.
+*/
+int message_send_to(dialog_t *dialog, int my_slot, const char *text, const slot_set_t *recipients);
+
+/*  Sends up to count messages (at most MAX_SEND_BATCH) to the given dialog, in order, reserving their
+    sequence numbers with a single compare-and-swap. texts[i] does not need to be NUL-terminated,
+    lens[i] is its length and must be between 1 and dialog->max_msg_size, and recipients[i] its
+    recipients (NULL for everybody; recipients itself may be NULL to send every message to everybody).
+    Sets may be shared between messages. It returns how many
+    of the messages, from the first one on, were sent; fewer than count means the dialog is full, or
+    that the next message can never be sent. For that message it returns -1: it is empty, longer than
+    max_msg_size or needs a bigger slab block than the whole arena, so waiting for room would not help.
+    The caller is expected to call dialog_notify once afterwards.
+*/
+int message_send_batch(dialog_t *dialog, int my_slot, const char *const *texts, const uint32_t *lens,
+                       const slot_set_t *const *recipients, int count);
+
+/*  Like message_send_batch for messages to everybody, but each message is marked as having crossed
+    hops[i] bridges (see message_t). Used by ./dialogbridge to publish the messages it relays.
+*/
+int message_relay_batch(dialog_t *dialog, int my_slot, const char *const *texts, const uint32_t *lens,
+                        const uint32_t *hops, int count);
+
+/*  Sends the length bytes at data to the given dialog as one stream, for the slots in recipients (NULL
+    for everybody): fragments of up to dialog->max_msg_size bytes (a few less for a directed stream,
+    so the recipient bitmap fits in the same slab block), published in order, each carrying stream_id, its offset in the payload
+    and the payload length, so that a receiver can copy it straight into place (see message_t).
+    stream_id must not be 0 and is chosen by the caller, so that receivers can tell the streams of
+    one sender apart.
+    At most window fragments of the stream are in the dialog at once: before publishing more, the
+    sender waits until the oldest ones have been read by their recipients and reclaimed, so a large
+    transfer never takes the whole ring or the whole arena from the other senders. window 0 picks a
+    quarter of the ring and a quarter of the arena. While the dialog is full it waits as publish_lines
+    does; fragments of the window count as "in the dialog" for the block timeout too.
+    It returns 0 once every fragment is published, ERROR_MSG_SIZE if length is 0 (or a fragment needs a
+    bigger slab block than the whole arena), or ERROR_LIMIT_REACHED
+    if the stream could not make progress for longer than the block timeout of the dialog; the rest
+    of the stream is then not sent.
+*/
+int message_send_stream(dialog_t *dialog, int my_slot, uint32_t stream_id, const char *data, uint64_t length,
+                        const slot_set_t *recipients, uint32_t window);
+
+/*  Posts a control event of the given kind (CONTROL_TERMINATE, CONTROL_FLUSH, CONTROL_PAUSE or
+    CONTROL_RESUME) to the dialog from my_slot and wakes its readers. CONTROL_FLUSH also syncs the journal
+    of the dialog, if it has one. It takes the dialog_lock, which only joins and leaves contend for.
+*/
+void message_control(dialog_t *dialog, int my_slot, uint32_t kind);
+
+/*  Like message_control, for an event that has crossed hops bridges. Used by ./dialogbridge.
+*/
+void message_relay_control(dialog_t *dialog, int my_slot, uint32_t kind, uint32_t hops);
+
+/*  Copies the next control event of the dialog that the given slot has not looked at yet into out and
+    moves the control cursor of the slot past it. It returns 1 if out was filled, 0 if there is none.
+    A slot that fell more than CONTROL_QUEUE_SIZE events behind skips the ones that were overwritten.
+*/
+int control_next(dialog_t *dialog, int my_slot, control_event_t *out);
+
+/*  Returns 1 if the given slot has a message that message_fetch can return right now, or a control event
+    that control_next can, 0 otherwise. While the dialog is paused only control events count.
+    It only looks at the cell under the read cursor, so it is cheap enough to be polled while spinning.
+*/
+int message_pending(dialog_t *dialog, int my_slot);
+
+/*  Like message_pending, for a membership: from view_seq if it reads with message_peek.
+*/
+int member_pending(const membership_t *member);
+
+/*  Copies the next unread message addressed to the given slot into out and advances the slot's read
+    cursor. Messages for other slots are passed over by looking at their header only.
+    It returns 1 if a message was copied or 0 if no new message has been published yet.
+    It takes no lock, so it may be called concurrently with senders.
+*/
+int message_fetch(dialog_t *dialog, int my_slot, received_message_t *out);
+
+/*  A message that message_peek left in shared memory instead of copying it.
+    seq: the sequence number of the message inside its dialog
+    sent_ns: when it was published (CLOCK_MONOTONIC)
+    data / length: its text in the payload arena of the dialog, not NUL-terminated
+    stream_id / stream_offset / stream_length: as in received_message_t
+    hops: the bridges the message has crossed (see message_t)
+*/
+typedef struct {
+    uint64_t seq;
+    uint64_t sent_ns;
+    const char *data;
+    uint32_t length;
+    int sender_slot;
+    pid_t sender_pid;
+    uint32_t stream_id;
+    uint64_t stream_offset;
+    uint64_t stream_length;
+    uint32_t hops;
+} message_view_t;
+
+/*  Like message_fetch, but without copying: it points view at the next message addressed to the slot at or
+    after *cursor (a cursor of the caller, which never trails the read cursor of the slot) and moves *cursor
+    past it. The read cursor itself stays where it is, so the message and its payload are kept in the ring
+    until they are released. It returns 1 if view was filled or 0 if no new message has been published yet.
+*/
+int message_peek(dialog_t *dialog, int my_slot, uint64_t *cursor, message_view_t *view);
+
+/*  Releases view, and with it every message before it, by moving the read cursor of the slot past it;
+    the cleanup may then reclaim them. Under the block policy a view stays intact until it is released.
+    Under drop-oldest and skip-lagging a slow reader's messages may be reclaimed earlier: it returns 0 if
+    the view was intact until now and -1 if it was reclaimed meanwhile (its data may have been overwritten).
+*/
+int message_release(dialog_t *dialog, int my_slot, const message_view_t *view);
+
+/*  Advances tail_seq past every message that all of its recipients have read. A message waits only
+    for the reading slots among its recipients whose cursor has not passed it yet, so a slow reader
+    holds back the messages addressed to it, but not the traffic between the others. Reclaimed
+    messages have their payload returned to the slab and their ring cell becomes reusable. Only one
+    process at a time runs it (the reclaiming flag holds its slot); the others simply return, since
+    that process is already doing the work for them. The tail is stored only after the payloads are
+    released, so a sender that sees the new tail may reuse the cells at once.
+
+    pressure is 0 for the normal cleanup. A sender that found the dialog full passes the number of
+    messages it wants to publish, and the flow-control policy of the dialog may then reclaim messages
+    that some recipients have not read yet: the oldest ones (drop-oldest), or the ones only readers
+    more than lag_limit behind are missing (skip-lagging). It returns the number of messages reclaimed.
+    The receive and send functions call it themselves; it is exported for ./microbench.
+*/
+uint64_t cleanup_read_messages(dialog_t *dialog, int my_slot, uint64_t pressure);
+
+/*  Receives and prints all the unread messages for the given slot, in the order they were sent.
+    The messages of one call are collected in a local buffer and written to stdout with a single
+    write(), so a reader redirected to a file or a pipe makes one syscall per batch. Nothing is received
+    while the dialog is paused, and nothing sent after the dialog was terminated.
+    It returns the number of messages received, or -1 once the dialog is terminated and every message sent
+    before that has been received; a line for the CONTROL_TERMINATE is printed then, as for a message.
+    If latency is not NULL, the queueing time of every message and the time of every write() are recorded in it.
+*/
+int message_receive(dialog_t *dialog, int my_slot, latency_t *latency);
+
+/*  Prints the latency histograms of the given dialogs to stderr: per dialog, and merged over all of
+    them if there are several.
+*/
+void latency_dump(const membership_t *members, int count);
+
+/*  Body of the thread that prints the latency histograms whenever the process gets SIGUSR1. The
+    signal must be blocked in every thread; this one takes it with sigwait. It exits when it gets the
+    signal after the terminate flag was raised. arg is the thread_args_t of the process.
 */
-int message_receive(dialog_t *dialog, int my_slot);
+void* signal_thread(void *arg);
 
 #endif
 
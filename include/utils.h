@@ -8,7 +8,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,16 +19,115 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-/*  We define some constants that signify the maximum capacities of the messaging system.
-    Each message can be up to 256 characters long, each dialog can contain up to 512 messages in total.
-    The max amount of dialog that can occur simultaneously is 32 and each dialog can have up to 16
-    participating processes at once. Under that are some error codes.
+#include "slab.h"
+#include "stats.h"
+
+/*  We define some constants that signify the capacities of the messaging system.
+    The capacities are chosen when the shared memory segment is created, from the environment of the
+    process that creates it (see load_config), and they are stored in the header of the segment, so
+    every process that attaches later uses the same values. Below are the defaults and the limits:
+    - DIALOG_MAX_DIALOGS: number of dialogs in the segment, 32 by default.
+    - DIALOG_MAX_PARTICIPANTS: participants per dialog, 16 by default, at most MAX_DIALOG_PARTICIPANTS
+      (1024). The participant bitmaps of a dialog take one 64-bit word per 64 participants.
+    - DIALOG_RING_SIZE: messages kept per dialog, 512 by default. It must be a power of two, because
+      the message ring of a dialog maps a sequence number to its cell with a mask instead of a division.
+    - DIALOG_MAX_MSG_SIZE: bytes per message, 4096 by default, at most MAX_MSG_SIZE. MAX_MSG_SIZE
+      sizes the buffers of the processes and can only be raised at compile time.
+    - DIALOG_ARENA_SIZE: bytes of payload arena per dialog, 64 KiB by default.
+    - DIALOG_SHM_KEY: the System V key of the segment, 612004 by default. Processes with different keys
+      use separate segments and separate global mutexes, so several instances can run side by side.
+*/
+
+#ifndef MAX_MSG_SIZE
+#define MAX_MSG_SIZE 4096
+#endif
+#define MAX_DIALOG_PARTICIPANTS 1024
+#define PARTICIPANT_WORDS (MAX_DIALOG_PARTICIPANTS / 64)         // 64-bit words of a participant bitmap
+
+#define DEFAULT_SHM_KEY 612004                                   // (my bday)
+#define DEFAULT_MAX_DIALOGS 32
+#define DEFAULT_PARTICIPANTS 16
+#define DEFAULT_RING_SIZE 512
+#define DEFAULT_ARENA_SIZE (64 * 1024)
+
+#define MAX_DIALOGS_LIMIT 4096
+#define MAX_RING_SIZE (1u << 20)
+#define MAX_ARENA_SIZE (1u << 30)
+#define MAX_JOINED_DIALOGS 64                                    // dialogs one process may follow (futex_waitv takes up to 128)
+#define MAX_STREAM_WINDOW 4096                                   // fragments of a stream in flight at most (DIALOG_STREAM_WINDOW)
+
+_Static_assert(MAX_MSG_SIZE <= SLAB_MAX_BLOCK && MAX_MSG_SIZE <= UINT16_MAX,
+               "MAX_MSG_SIZE must fit in one slab block and in message_t.payload_len");
+_Static_assert(MAX_DIALOG_PARTICIPANTS % 64 == 0 && MAX_DIALOG_PARTICIPANTS <= UINT16_MAX,
+               "participant bitmaps are whole 64-bit words and slots must fit in message_t.sender_slot");
+
+/*  Identifies the layout of the shared memory segment. DIALOG_SHM_VERSION must be bumped whenever
+    shared_memory_t, dialog_t or message_t change, so that a process never works on a segment that
+    was laid out by an incompatible build.
+*/
+#define DIALOG_SHM_MAGIC 0x444c4753u                             // "DLGS"
+#define DIALOG_SHM_VERSION 15
+
+/*  Value of message_t.seq once the message with sequence number n is published. Only the low
+    30 bits of n are kept, which is plenty to tell the laps of a ring of up to MAX_RING_SIZE cells apart, and the
+    value is never 0 (0 means "being written").
+    MSG_SEQ_RECLAIMED is set by the cleanup once the message has been read by everyone and its payload
+    has been released. A reader that still looks at the cell (because it got lapped) sees the
+    change and drops whatever it copied.
 */
+#define MSG_CELL_SEQ(n) ((uint32_t)(((n) & 0x3fffffffu) + 1))
+#define MSG_SEQ_RECLAIMED (1u << 31)
 
-#define MAX_MSG_SIZE 256
-#define MAX_MSGS_PER_DIALOG 512
-#define MAX_DIALOG_PARTICIPANTS 16
-#define MAX_DIALOGS 32
+/*  Kinds of participants, passed to join_dialog. A send-only participant may send messages
+    but never reads, so its read cursor does not hold back the reclamation of messages.
+*/
+#define SLOT_FREE 0
+#define SLOT_READER 1
+#define SLOT_SEND_ONLY 2
+
+/*  Flow-control policies of a dialog, i.e. what a sender does when the dialog is full (no ring cell
+    or no payload space left). The policy is chosen by the process that activates the dialog, from
+    DIALOG_BACKPRESSURE, and stays until the dialog becomes empty again.
+    BACKPRESSURE_BLOCK: the sender waits until the readers make room, for at most block_timeout_ms
+    (0 waits forever). Messages are only lost if the timeout expires, and the sender reports it.
+    BACKPRESSURE_DROP_OLDEST: the oldest messages are reclaimed even if some reader has not read them,
+    so senders never wait. A reader that falls behind skips the messages it missed.
+    BACKPRESSURE_SKIP_LAGGING: readers that are more than lag_limit messages behind no longer hold
+    back the reclamation; they skip what they missed, like under DROP_OLDEST. If the dialog is full
+    because of readers within the limit, the sender blocks as under BACKPRESSURE_BLOCK.
+*/
+#define BACKPRESSURE_BLOCK 0
+#define BACKPRESSURE_DROP_OLDEST 1
+#define BACKPRESSURE_SKIP_LAGGING 2
+
+/*  Kinds of control events (see control_event_t). They do not travel through the message ring, so
+    they reach every participant at once, also when the ring is full or the policy drops messages.
+    CONTROL_TERMINATE: ends the dialog. Readers still receive the messages sent before it, then stop.
+    CONTROL_FLUSH: asks for everything sent so far to be pushed out: the journal of the dialog is synced
+    and programs that buffer what they receive (libdialog.h) are told to write it out.
+    CONTROL_PAUSE / CONTROL_RESUME: readers stop taking messages out of the dialog, and start again.
+    CONTROL_JOIN / CONTROL_LEAVE: a participant joined or left the dialog, posted by join_dialog and
+    leave_dialog (a reaped participant leaves too).
+*/
+#define CONTROL_TERMINATE 1
+#define CONTROL_FLUSH 2
+#define CONTROL_PAUSE 3
+#define CONTROL_RESUME 4
+#define CONTROL_JOIN 5
+#define CONTROL_LEAVE 6
+
+#define CONTROL_QUEUE_SIZE 64                                    // control events kept per dialog, a power of two
+
+#define JOURNAL_PATH_MAX 256                                     // longest journal file path (see journal.h)
+
+/*  Participants that die without leaving are found by reap_dead_participants, which runs whenever a
+    process joins a dialog, and at most every REAP_INTERVAL_MS while a dialog is full (reap_if_due).
+    MUTEX_READY is the value of shared_memory_t.mutex_state once the global mutex is usable, and
+    DIALOG_READY the value of dialog_t.init_state once the dialog is initialized.
+*/
+#define REAP_INTERVAL_MS 100
+#define MUTEX_READY UINT32_MAX
+#define DIALOG_READY UINT32_MAX
 
 /*  A general comment is that we have avoided the use of booleans inside the code as ints are easier to work with.
     Since our memory is not limited to the point that we need to optimize 1 byte instead of 4, we have gone with int.
@@ -35,100 +136,535 @@
 /*  The message_t struct represents a single message inside a dialog.
     Since the struct is stored inside shared memory we don't use pointers, so all fields are
     just plain data types. Below is the logic behind the picking of all data types:
-    message_exists: marks whether the specified slot message is in use (could have been a boolean).
-    dialog_id: the dialog in which the message is present
+    seq: publication marker of the ring cell. It holds MSG_CELL_SEQ(sequence number) once the message
+    with that sequence number is fully written, and 0 while a writer is filling the cell in.
+    payload_off: offset of the message text inside the payload arena of the dialog
+    payload_len: length of the message text in bytes (it is not NUL-terminated in the arena)
     sender_slot: the index of the sender inside the dialog
-    msg_text: the actual text being carried by the message.
-    has_been_read_by: marks the index of the participants slot that has seen the message (could have also been a boolean) 
+    sender_pid: the process id of the sender
+    recipient_words: 0 for a message to everybody. A directed message carries its recipients as a
+    bitmap of that many 64-bit words (see slot_set_t), in its payload block right after the text (see
+    message_recipients), so the header stays the same size however many participants the dialog has.
+    Readers skip the messages not for them without copying their text, and the cleanup waits for the
+    recipients only. RECIPIENTS_NOBODY marks the empty messages the reaper publishes.
+    sent_ns: CLOCK_MONOTONIC time at which the message was published, for the latency histograms
+    stream_id / stream_offset / stream_length: set on the fragments of a streamed payload (see
+    message_send_stream): the number its sender gave the stream, where the text of the fragment goes
+    in the payload and the length of the whole payload. stream_id is 0 for an ordinary message.
+    hops: how many bridges (./dialogbridge) the message has crossed to get into this segment, 0 for
+    a message sent here. Bridges use it to stop a message that goes round a cycle of bridges.
 
+    The text itself lives in the slab arena of the dialog and the dialog is implied by the ring the
+    header sits in. Every header has a cache line of its own: with two per line, a sender filling
+    in the next cell would take the line away from a reader still reading the previous one, which
+    is the common case when readers keep up. The rest of the line is reserved.
 */
 
 typedef struct {
-    int message_exists;
-    int dialog_id;
-    int sender_slot;
+    _Alignas(64) _Atomic uint32_t seq;
+    uint32_t payload_off;
+    uint16_t payload_len;
+    uint16_t sender_slot;
     pid_t sender_pid;
-    char msg_text[MAX_MSG_SIZE];
-    int has_been_read_by[MAX_DIALOG_PARTICIPANTS];
+    uint32_t recipient_words;
+    uint32_t stream_id;
+    uint64_t sent_ns;
+    uint64_t stream_offset;
+    uint64_t stream_length;
+    uint32_t hops;
+    uint32_t reserved[3];
 } message_t;
 
+_Static_assert(sizeof(message_t) == 64, "message_t is meant to fill one cache line");
+
+#define RECIPIENTS_NOBODY UINT32_MAX                             // recipient_words of an abandoned cell
+
+/*  One control event of a dialog, in the control queue (see dialog_t.control_seq).
+    seq: control sequence number n + 1 once event n is fully written, 0 while it is being written.
+    A reader that copied the event checks seq again afterwards: if it changed, a poster reused the
+    entry meanwhile.
+    kind: CONTROL_TERMINATE ... CONTROL_LEAVE
+    slot / pid: the participant that posted the event, or that joined or left
+    hops: the bridges the event has crossed, as message_t.hops
+    data_seq: write_seq of the dialog when the event was posted. The messages sent before it are the
+    ones below data_seq, so a reader can tell where the event falls among them.
+*/
+typedef struct {
+    _Atomic uint64_t seq;
+    uint32_t kind;
+    int32_t slot;
+    pid_t pid;
+    uint32_t hops;
+    uint64_t data_seq;
+} control_event_t;
+
+/*  A set of participant slots, such as the recipients of a message: slot s is bit s % 64 of words[s / 64].
+*/
+typedef struct {
+    uint64_t words[PARTICIPANT_WORDS];
+} slot_set_t;
+
+static inline void slot_set_add(slot_set_t *set, int slot) {
+    set->words[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+/*  Returns the number of 64-bit words a bitmap of n participant slots takes.
+*/
+static inline uint32_t participant_words(uint32_t n) {
+    return (n + 63) / 64;
+}
+
+/*  Returns the size of the payload block of a message with a text of len bytes and recipient_words
+    words of recipient bitmap: the text, then the bitmap at the next multiple of 8 bytes.
+*/
+static inline uint32_t message_block_len(uint32_t len, uint32_t words) {
+    if (words == 0 || words == RECIPIENTS_NOBODY) return len;
+    return ((len + 7) & ~7u) + words * 8;
+}
+
+/*  The cursors of one participant slot. The reading side of the slot writes read_seq and its sending
+    side the reserved range, so the two are on separate cache lines, and no two slots share one:
+    readers and senders on different cores never take lines away from each other.
+    read_seq: the read cursor, the sequence number of the next message the slot will read
+    pending_seq / pending_count: the range of sequence numbers the slot has reserved but not yet
+    published. If the slot dies before publishing them, the reaper publishes empty messages in their
+    place (payload_len 0), which readers skip, so the ring does not stall behind them.
+    pid: the process in the slot, 0 while it is free. It only changes on join and leave.
+    control_seq: the control cursor, the number of the next control event the slot will look at. It
+    is written by the reading side only, so it shares the line of read_seq.
+*/
+typedef struct {
+    _Alignas(64) _Atomic uint64_t read_seq;
+    _Atomic uint64_t control_seq;
+    _Alignas(64) _Atomic uint64_t pending_seq;
+    _Atomic uint32_t pending_count;
+    pid_t pid;
+} slot_cursor_t;
+
 /*  The dialog_t struct represents a single dialog between processes:
     is_active: indicates whether the specified dialog_slot is used.
     dialog_id: unique id for the dialog
     dialog_participants: the number of active participants (processes) in a dialog
-    slots_used: marks which participant slots are occupied.
-    pids: the process ids of all the processes that are taking part in the dialog
-    slot_sem: one semaphore per participant slot
-    sem_initialized: initializer for the semafores, ensures semaphores are initialized only once
-    messages: the messages contained in th dialog.
+    max_participants / max_msg_size: the capacities of the dialog, copied from the segment header.
+    ring_size / ring_mask: number of cells of the message ring and ring_size - 1.
+    cursors_offset / slot_stats_offset / ring_offset / arena_offset / staging_offset: where the per-slot
+    cursors and counters, the message ring, the payload arena and the journal staging area of this
+    dialog start, in bytes from the start of the dialog_t itself (see dialog_cursors, dialog_slot_stats,
+    dialog_messages, dialog_payloads and dialog_staging).
+    staging_size: bytes of the journal staging area, enough for a record of the longest message
+    backpressure / block_timeout_ms / lag_limit: the flow-control policy of the dialog and its
+    parameters (see BACKPRESSURE_BLOCK). They are set when the dialog is activated.
+    journal_enabled / journal_sync_ms / journal_path: whether the dialog keeps a journal (journal.h),
+    how often it is synced to disk and its file, which every participant maps. Also set on activation.
+    segment_offset: where this dialog_t starts, in bytes from the start of the segment (see dialog_segment)
+    participant_words: the words of the participant bitmaps this dialog uses, enough for max_participants
+    slot_mask: bit s % 64 of word s / 64 is set while participant slot s is occupied.
+    reader_mask: the same for the slots occupied by a participant that reads (SLOT_READER).
+    Only these slots hold back the cleanup, so it visits just their cursors.
+    notify_word: futex word of the dialog. Senders increment it after publishing, readers sleep on it.
+    sleepers: number of readers that are (about to be) asleep on notify_word. Senders only make the
+    wakeup system call when it is not 0.
+    space_word / space_waiters: the same pair in the other direction. The cleanup increments space_word
+    when it frees cells, senders that wait for room in a full dialog sleep on it.
+    dialog_lock: inter-process lock of this dialog only. It protects joining and leaving the dialog,
+    so traffic in one dialog never waits for another dialog. It is a robust process-shared mutex: if
+    its owner dies, the next process that locks it takes it over (see lock_counted).
+    init_state: 0 until the dialog is first used, then the pid of the process initializing it and
+    finally DIALOG_READY (see prepare_dialog). A new segment is all zeroes, which is how a dialog
+    nobody has used yet looks, so it is not written, nor its pages faulted in, before its first join.
+    next_reap_ns: CLOCK_MONOTONIC time before which reap_if_due does not run again.
+    write_seq: sequence number that the next sent message will get. It only ever grows.
+    tail_seq: oldest sequence number still kept in the ring. Everything below it has been
+    read by every active participant and its cell may be reused.
+    reclaiming: the slot + 1 of the process that runs the cleanup of the dialog, 0 when nobody does,
+    so payloads are released only once. The reaper clears it if that process has died.
+    stage_tail / staged_seq: bytes of journal records ever put into the staging area, and the sequence
+    number after the last message put there. Only the holder of reclaiming writes them (journal.h).
+    stage_head: bytes of journal records ever taken out of the staging area into the journal file.
+    draining: the pid of the process that takes them out, 0 when nobody does.
+    journal_word / journal_waiters: the futex pair of the journal threads, as space_word for senders.
+    The cleanup bumps journal_word when the staging area gets half full.
+    slab: the allocator of the payload arena, which holds the message texts.
+    control_seq: number of control events posted to the dialog. Event n is in control[n % CONTROL_QUEUE_SIZE],
+    so a participant that falls more than CONTROL_QUEUE_SIZE events behind misses the oldest ones; the
+    state that must not be missed is kept in the fields below, which readers consult directly.
+    terminate_seq / terminate_slot / terminate_pid: data_seq + 1 of the first CONTROL_TERMINATE (0 while
+    the dialog is not terminated) and who posted it. The dialog stays terminated until it becomes empty.
+    paused: 1 between a CONTROL_PAUSE and the next CONTROL_RESUME (or CONTROL_TERMINATE)
+    control: the control queue. Events are posted under the dialog_lock and read without a lock.
+    stats: statistics counters of the dialog (see stats.h).
+
+    The fields are grouped by who writes them, and every group that is written while messages flow
+    starts a cache line of its own: write_seq (every sender), notify_word and sleepers (every sender,
+    while readers spin on them), tail_seq, reclaiming and the staging tail (the cleanup), the staging
+    head and the journal futex (the journal threads), space_word and space_waiters, the slab, and the
+    control queue, which every reader polls but which is only written when control events are posted.
+    Everything before write_seq only changes when participants join or leave, so it stays cached in
+    every core.
+
+    The per-slot state, the ring and the arena are not members of the struct because their sizes are
+    only known when the segment is created. They follow the dialog_t in the same region of the
+    segment: the cursors and the counters of every slot (slot_cursor_t and slot_stats_t, see stats.h,
+    max_participants of each), the ring, the arena and the journal staging area. A dialog for a few
+    participants is therefore no bigger than before the limit went up to MAX_DIALOG_PARTICIPANTS, and
+    the message with sequence number n lives in dialog_messages(dialog)[n & dialog->ring_mask].
+
+    write_seq, tail_seq and read_seq together replace the old "scan for a free/unread slot" logic:
+    a message lives in the ring while tail_seq <= n < write_seq, so sending and receiving are O(1)
+    and messages come out in the order they were sent.
 */
 typedef struct {
     int is_active;
     int dialog_id;
     int dialog_participants;
-    int slot_used[MAX_DIALOG_PARTICIPANTS];
-    pid_t pids[MAX_DIALOG_PARTICIPANTS];
-    sem_t slot_sem[MAX_DIALOG_PARTICIPANTS];
-    int sem_initialized;
-    message_t messages[MAX_MSGS_PER_DIALOG];
+    uint32_t max_participants;
+    uint32_t max_msg_size;
+    uint32_t ring_size;
+    uint64_t ring_mask;
+    uint64_t cursors_offset;
+    uint64_t slot_stats_offset;
+    uint64_t ring_offset;
+    uint64_t arena_offset;
+    uint64_t staging_offset;
+    uint32_t staging_size;
+    int backpressure;
+    uint32_t block_timeout_ms;
+    uint64_t lag_limit;
+    int journal_enabled;
+    uint32_t journal_sync_ms;
+    char journal_path[JOURNAL_PATH_MAX];
+    uint32_t participant_words;
+    _Atomic uint64_t slot_mask[PARTICIPANT_WORDS];
+    _Atomic uint64_t reader_mask[PARTICIPANT_WORDS];
+    uint64_t segment_offset;
+    pthread_mutex_t dialog_lock;
+    _Atomic uint32_t init_state;
+    _Atomic uint64_t next_reap_ns;
+    _Alignas(64) _Atomic uint64_t write_seq;
+    _Alignas(64) _Atomic uint32_t notify_word;
+    _Atomic uint32_t sleepers;
+    _Alignas(64) _Atomic uint64_t tail_seq;
+    _Atomic int reclaiming;
+    _Atomic uint64_t stage_tail;
+    uint64_t staged_seq;
+    _Alignas(64) _Atomic uint64_t stage_head;
+    _Atomic pid_t draining;
+    _Atomic uint32_t journal_word;
+    _Atomic uint32_t journal_waiters;
+    _Alignas(64) _Atomic uint32_t space_word;
+    _Atomic uint32_t space_waiters;
+    _Alignas(64) slab_t slab;
+    _Alignas(64) _Atomic uint64_t control_seq;
+    _Atomic uint64_t terminate_seq;
+    int32_t terminate_slot;
+    pid_t terminate_pid;
+    _Atomic uint32_t paused;
+    control_event_t control[CONTROL_QUEUE_SIZE];
+    dialog_stats_t stats;
 } dialog_t;
 
-/*  The shared_memory_t struct is the top level structure which gets saved in shared memory
-    and it is accessed by all processes.
+/*  The shared_memory_t struct is the header of the shared memory segment, and it is accessed by all
+    processes. The dialogs follow it, each one in a region of dialog_stride bytes:
+    magic / version: DIALOG_SHM_MAGIC and DIALOG_SHM_VERSION, written by the initialization
+    segment_size: size of the segment in bytes
+    shm_key: the System V key of the segment. A process keeps its journal mappings per key and dialog
+    id (journal.c), so the dialogs of two segments never share one.
+    max_dialogs, max_participants, ring_size, max_msg_size, arena_size: the capacities the segment
+    was created with
+    dialogs_offset: where the region of dialog 0 starts, in bytes from the start of the segment
+    dialog_stride: size of the region of one dialog (dialog_t, message ring and payload arena)
+    mutex_state: 0 in a new segment, the pid of the process initializing the global mutex, then MUTEX_READY
+    mutex: the global mutex (see the mutex variable below)
+    removed: set by the last process, under the mutex, once it has removed the segment. A process that
+    attached the segment just before that finds it set and starts over with a new segment.
     is_initialized: ensures initialization happens only once
-    total_processes: the number of processes present in shared memory
-    dialogs: array of all dialogs in the system
+    ready_dialogs: bit i is set once dialog i is initialized, so that whoever looks at every dialog
+    (the cleanup, ./dialogstat) skips the ones never used without touching their memory
+    total_processes: the number of registrations in shared memory, one per dialog a process takes part
+    in. The reaper decrements it for every participant that died, so the segment is still removed
+    when the last process leaves.
+    mutex_stats: the counters of the global mutex (see stats.h)
 */
 typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_size;
+    key_t shm_key;
+    uint32_t max_dialogs;
+    uint32_t max_participants;
+    uint32_t ring_size;
+    uint32_t max_msg_size;
+    uint32_t arena_size;
+    uint64_t dialogs_offset;
+    uint64_t dialog_stride;
+    _Atomic uint32_t mutex_state;
+    pthread_mutex_t mutex;
+    int removed;
     int is_initialized;
-    int total_processes;
-    dialog_t dialogs[MAX_DIALOGS];
+    _Atomic uint64_t ready_dialogs[MAX_DIALOGS_LIMIT / 64];
+    _Atomic int total_processes;
+    lock_stats_t mutex_stats;
 } shared_memory_t;
 
+/*  The capacities, the flow-control policy and the journal settings requested by the environment of
+    a process, see load_config. journal_dir is NULL when journaling is off; replay is set when the
+    process wants to replay the journal from replay_from on when it joins.
+    lag_limit 0 means three quarters of the ring of the dialog, so that a reader in the middle of a
+    full batch (MAX_SEND_BATCH messages) is not taken for a lagging one.
+    latency_at_exit: set by DIALOG_LATENCY_AT_EXIT=1; ./dialog then prints its latency histograms
+    to stderr when it exits, as it does on SIGUSR1.
+    stream_window: DIALOG_STREAM_WINDOW, the fragments a stream sent by this process may have in a
+    dialog at once; 0 picks a quarter of the ring and of the arena (see message_send_stream).
+*/
+typedef struct {
+    key_t shm_key;
+    uint32_t max_dialogs;
+    uint32_t max_participants;
+    uint32_t ring_size;
+    uint32_t max_msg_size;
+    uint32_t arena_size;
+    int backpressure;
+    uint32_t block_timeout_ms;
+    uint32_t lag_limit;
+    const char *journal_dir;
+    uint64_t journal_size;
+    uint32_t journal_sync_ms;
+    int replay;
+    uint64_t replay_from;
+    int latency_at_exit;
+    uint32_t stream_window;
+} dialog_config_t;
+
+/*  Returns the dialog with the given id. The id must be below shared_mem->max_dialogs.
+*/
+static inline dialog_t *dialog_at(shared_memory_t *shared_mem, int dialog_id) {
+    return (dialog_t*)((char*)shared_mem + shared_mem->dialogs_offset + (uint64_t)dialog_id * shared_mem->dialog_stride);
+}
+
+/*  Returns 1 if the dialog with the given id has been initialized (see prepare_dialog).
+*/
+static inline int dialog_ready(shared_memory_t *shared_mem, int dialog_id) {
+    return (int)(atomic_load(&shared_mem->ready_dialogs[dialog_id / 64]) >> (dialog_id % 64) & 1);
+}
+
+/*  Returns the segment header of the dialog.
+*/
+static inline shared_memory_t *dialog_segment(dialog_t *dialog) {
+    return (shared_memory_t*)((char*)dialog - dialog->segment_offset);
+}
+
+/*  Returns the cursors of the participant slots of the dialog (max_participants of them).
+*/
+static inline slot_cursor_t *dialog_cursors(dialog_t *dialog) {
+    return (slot_cursor_t*)(void*)((char*)dialog + dialog->cursors_offset);
+}
+
+/*  Returns the statistics counters of the participant slots of the dialog (max_participants of them).
+*/
+static inline slot_stats_t *dialog_slot_stats(dialog_t *dialog) {
+    return (slot_stats_t*)(void*)((char*)dialog + dialog->slot_stats_offset);
+}
+
+/*  Returns the message ring of the dialog (ring_size cells).
+*/
+static inline message_t *dialog_messages(dialog_t *dialog) {
+    return (message_t*)((char*)dialog + dialog->ring_offset);
+}
+
+/*  Returns the payload arena of the dialog (slab.arena_size bytes).
+*/
+static inline char *dialog_payloads(dialog_t *dialog) {
+    return (char*)dialog + dialog->arena_offset;
+}
 
-/*  Global mutex semaphore. It is used to protect critical sections of the code that modify
-    shared memory. It is shared by all processes and prevents race conditions between them.
+/*  Returns the journal staging area of the dialog (staging_size bytes, see journal.h).
 */
-extern sem_t *mutex;
+static inline char *dialog_staging(dialog_t *dialog) {
+    return (char*)dialog + dialog->staging_offset;
+}
+
+/*  Returns the recipient bitmap of a directed message whose text is at off and len bytes long.
+*/
+static inline const uint64_t *message_recipients(dialog_t *dialog, uint32_t off, uint32_t len) {
+    return (const uint64_t*)(void*)(dialog_payloads(dialog) + off + ((len + 7) & ~7u));
+}
+
+/*  Returns whether bit slot is set in one of the participant bitmaps of a dialog.
+*/
+static inline int slot_in(_Atomic uint64_t *mask, int slot) {
+    return atomic_load(&mask[slot / 64]) >> (slot % 64) & 1;
+}
+
+/*  Returns 1 if the dialog has been terminated and cursor has reached the messages sent after the
+    CONTROL_TERMINATE, i.e. a reader at cursor has everything sent before it.
+*/
+static inline int dialog_terminated(dialog_t *dialog, uint64_t cursor) {
+    uint64_t end = atomic_load_explicit(&dialog->terminate_seq, memory_order_acquire);
+    return end != 0 && cursor >= end - 1;
+}
+
+/*  Global mutex. It is used to protect the global state of the shared memory: its
+    initialization, total_processes and the final cleanup. It is shared by all processes.
+    Everything that belongs to a single dialog is protected by that dialog's dialog_lock instead,
+    and sending and receiving messages take no lock at all: the message ring is driven by atomics only.
+    It lives in the header of the segment (shared_memory_t.mutex) and is a robust process-shared
+    mutex, so a process that dies while holding it does not stall the others.
+*/
+extern pthread_mutex_t *mutex;
 
 
 ////////////////////////// FUNCTIONS //////////////////////////
 
-/*  Checks whether the command line arguments given to the program are valid. 
-    It returns the dialog_id on success and it exits the program on failure. 
+/*  Checks whether the command line arguments given to the program are valid: one or more distinct
+    dialog ids, at most MAX_JOINED_DIALOGS of them. It stores them in ids, in the order given, and
+    returns how many there are; it exits the program on failure. Whether an id exists in the segment
+    is only known after attaching it, see check_layout.
+*/
+int check_argument_validity(int argc, char* argv[], int *ids);
+
+/*  Fills cfg with the capacities requested through the DIALOG_* environment variables, using the
+    defaults for the variables that are not set. It exits the program if a value is invalid.
+    Only the process that creates the segment uses the capacities, and only the process that
+    activates a dialog uses the flow-control policy and the journal settings.
+*/
+void load_config(dialog_config_t *cfg);
+
+/*  The functions below that end the program on failure each have a try_ variant, for the library
+    (libdialog.h), which must not end the program it is linked into. The variant reports the problem
+    on stderr like the original, leaves the global mutex released and the segment detached, and returns
+    the exit code the original would have used, with errno set: EINVAL for a bad DIALOG_* variable or
+    dialog id, EPROTO for a segment of another layout or size, and that of shmget, shmat or shmctl
+    when those fail. They return 0 on success.
+*/
+int try_load_config(dialog_config_t *cfg);
+
+/*  Creates a shared memory segment sized for cfg if none exists for cfg->shm_key yet, and attaches
+    it (or the existing one, whatever its size) to the process address space. It then initializes the
+    global mutex of the segment if nobody has done so yet, stores it in mutex and acquires it.
+    Input: the configuration and the parameter that receives the shared memory ID
+    Output: a pointer to the now attached shared_memory_t header, with the global mutex held.
+    It exits the program if the segment was laid out by an incompatible build.
 */
-int check_argument_validity(int argc, char* argv[]);
+shared_memory_t* attach_and_lock_shared_mem(const dialog_config_t *cfg, int *out_shm_id);
+int try_attach_and_lock_shared_mem(const dialog_config_t *cfg, shared_memory_t **out, int *out_shm_id);
 
-/*  Creates a shared memory segment if one does not already exist and attaches it
-    to the process address space. 
-    Input: the parameter that receives the shared memory ID
-    Output: a pointer to the now attached shared_memory_t structre.
+/*  Initializes the shared memory contents. Writes the header with the capacities of cfg and marks
+    the shared memory as initialized; the dialogs are initialized one by one on their first join
+    (see prepare_dialog), so this takes the same few microseconds whatever the capacities. Should be
+    called inside a mutex because it must be called only once, even if many processes start simultaneously.
+    If a process died while initializing, the next one simply starts over.
+    It exits the program if the segment is too small for cfg (it was created by a process with another config).
 */
-shared_memory_t* create_and_attach_shared_mem(int *out_shm_id);
+void init_shared_memory(shared_memory_t *shared_mem, const dialog_config_t *cfg, int shm_id);
+int try_init_shared_memory(shared_memory_t *shared_mem, const dialog_config_t *cfg, int shm_id);
 
-/*  Initializes the shared memory contents. Sets all initial values for all dialogs
-    and messages and marks the shared memory as initialized. Should be called inside 
-    a mutex because it must be called only once, even if many processes start simultaneously.
+/*  Creates a segment sized for cfg in the private memory of the calling process (an anonymous mapping)
+    instead of System V shared memory, writes its header as init_shared_memory does and points mutex
+    to its global mutex. No other process can attach it, so it is only good for measuring the code
+    paths of one process (see ./microbench). It exits the program if the memory can not be mapped.
 */
-void init_shared_memory(shared_memory_t *shared_mem);
+shared_memory_t* create_private_segment(const dialog_config_t *cfg);
+
+/*  Returns the dialog with the given id, initializing it first if nobody has used it yet in this
+    segment: its capacities and offsets from the header, and its dialog_lock. Everything else starts
+    as the zeroes of the new segment, and the ring and the arena are only touched as messages flow.
+    The first process claims init_state with a compare-and-swap and the others wait until it is
+    DIALOG_READY, as for the global mutex. Should be called by a registered process (so the cleanup
+    can not run meanwhile) and without holding the dialog_lock, before joining the dialog.
+*/
+dialog_t* prepare_dialog(shared_memory_t *shared_mem, int dialog_id);
+
+/*  Checks that the attached segment has the layout of this build and that dialog_id exists in it
+    (-1 skips the dialog check). Should be called with the global mutex held, after init_shared_memory.
+    On failure it releases the mutex (removing the segment if no process uses it yet) and exits the program.
+*/
+void check_layout(shared_memory_t *shared_mem, int shm_id, int dialog_id);
+int try_check_layout(shared_memory_t *shared_mem, int shm_id, int dialog_id);
+
+/*  Returns 1 if no process with the given pid exists any more. A process we may not signal
+    (EPERM) exists, so only ESRCH counts.
+*/
+int process_dead(pid_t pid);
+
+/*  Returns the time of CLOCK_MONOTONIC in nanoseconds.
+*/
+uint64_t monotonic_ns(void);
+
+/*  Acquires an inter-process lock (the global mutex or a dialog_lock) and records the acquisition
+    in stats. Only an acquisition that finds the lock taken reads the clock, so an uncontended one
+    costs no more than before. If the previous owner died holding the lock, the lock is taken over
+    and counted as recovered; the state it protected is repaired by reap_dead_participants (for a
+    dialog_lock) or by starting the initialization or the removal over (for the global mutex).
+*/
+void lock_counted(pthread_mutex_t *lock, lock_stats_t *stats);
+
+/*  Unregisters a process from total_processes, which never goes below 0.
+*/
+void unregister_process(shared_memory_t *shared_mem);
+
+/*  Makes the dialog active, with the flow-control policy and the journal of cfg, unless it is active already.
+    Should be called with the dialog_lock of the dialog held, before join_dialog.
+*/
+void activate_dialog(dialog_t *dialog, int dialog_id, const dialog_config_t *cfg);
 
 /*  Assings the calling proccess to a free slot in the dialog they selected.    
     It returns the slot_index assigned to the process on success, or a negative
-    value if the dialog is full.
+    value if the dialog is full (the caller still has to release the dialog_lock then).
+    Should be called with the dialog_lock of the dialog held. Participants that have died are reaped first.
+    mode is SLOT_READER for normal participants or SLOT_SEND_ONLY for processes that never read.
+    The read cursor of the new slot starts at the oldest message still kept in the ring,
+    so the newcomer also sees messages that nobody has reclaimed yet, and its control cursor after its
+    own CONTROL_JOIN.
 */
-int join_dialog(dialog_t *dialog, pid_t pid);
+int join_dialog(dialog_t *dialog, pid_t pid, int mode);
 
-/*  Removes a process from a dialog. This happens when a "TERMINATE" message is received
+/*  Removes a process from a dialog. This happens when the dialog has been terminated (CONTROL_TERMINATE)
     or when a process exits a dialog unexpectedly. This function frees the participant slot, 
-    it updates the metadata of the dialog, and it might trigger a cleanup if the dialog
-    becomes empty after the process' departure.
+    it updates the metadata of the dialog, and it marks the dialog inactive if it
+    becomes empty after the process' departure, journaling the messages left in the ring first.
+    Should be called with the dialog_lock of the dialog held; total_processes is left to the caller,
+    under the global mutex.
+*/
+void leave_dialog(dialog_t *dialog, int my_slot);
+
+/*  Posts a control event of the given kind for the participant in slot, which has crossed hops bridges,
+    and updates the terminate and pause state of the dialog. Should be called with the dialog_lock of
+    the dialog held; waking the readers is left to the caller (see message_control).
+*/
+void post_control(dialog_t *dialog, uint32_t kind, int slot, uint32_t hops);
+
+/*  Turns the slot into a send-only one (SLOT_SEND_ONLY): its cursor no longer holds back the reclamation
+    of messages. Used by a process that follows several dialogs once one of them has been terminated,
+    while it stays in the others. Should be called with the dialog_lock of the dialog held.
 */
-void leave_dialog(shared_memory_t *shared_mem, dialog_t *dialog, int my_slot);
+void stop_reading(dialog_t *dialog, int my_slot);
 
-/*  Performs cleanup after all processes have exited the program. It destroys the semaphores
-    and it detaches and removes the shared memory segment from the system.
+/*  Finds the participants of the dialog whose process no longer exists and removes them as if they had
+    left: their slots are freed, their read cursors stop holding back the cleanup, the messages they
+    had reserved but not published are replaced by empty ones and they are unregistered from
+    total_processes. A cleanup they were running is released as well.
+    A process that is dead but not yet waited for by its parent (a zombie) still counts as alive.
+    Should be called with the dialog_lock of the dialog held. It returns the number of participants reaped.
 */
-void cleanup_if_last_process(shared_memory_t *shared_mem, int shm_id);
+int reap_dead_participants(dialog_t *dialog);
 
+/*  Runs reap_dead_participants if it has not run for REAP_INTERVAL_MS and the dialog_lock is free.
+    Called by senders that find the dialog full, so a dead reader is noticed even if nobody joins.
+*/
+void reap_if_due(dialog_t *dialog);
+
+/*  Performs cleanup after all processes have exited the program: when total_processes is 0, or when
+    this is the only process still attached (the others died without unregistering). Should be called
+    with the global mutex held. It destroys the dialog locks, marks the segment removed, releases the
+    mutex and detaches and removes the shared memory segment from the system. It returns 1 if it did,
+    and 0 (with the mutex still held) if other processes remain.
+*/
+int cleanup_if_last_process(shared_memory_t *shared_mem, int shm_id);
+
+/*  Detaches the process from the segment. Should be called with the global mutex held, after
+    total_processes has been updated: if no process is left, it performs the global cleanup,
+    otherwise it releases the mutex and closes this process's handles only.
+*/
+void detach_shared_memory(shared_memory_t *shared_mem, int shm_id);
 
 #endif
@@ -0,0 +1,531 @@
+/* bench.c
+    Multi-process load generator for the dialog system. It forks N sender and M receiver
+    processes spread over K dialogs of the same shared memory segment that ./dialog uses,
+    pushes messages of a configurable size and rate through them and reports the throughput
+    and the send-to-delivery latency percentiles. The last sender of a dialog to finish terminates
+    it (CONTROL_TERMINATE), and a receiver stops once it has received everything sent before that.
+
+    With -P it runs a ping-pong instead: two processes, pinned to two different CPUs, bounce one
+    message back and forth through one dialog -n times and the round-trip times are reported. With a
+    single message in flight the time is dominated by the cache lines that move between the two cores
+    on every hop, so this is the benchmark for the layout of the shared structures.
+
+    With -S bytes every sender streams -n payloads of that size instead (message_send_stream), and
+    the receivers put the fragments in place in a buffer of their own without copying them out of
+    the ring first, as a libdialog program does. It reports the payload throughput and the time from
+    the first fragment of a stream until the last one is in place.
+
+    Usage: ./bench [-s senders] [-r receivers] [-d dialogs] [-o first_dialog]
+                   [-n msgs_per_sender] [-b msg_bytes] [-R msgs_per_sec_per_sender] [-P] [-S stream_bytes]
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "../include/dialog.h"
+
+#define ERROR_BAD_OPTION 1
+#define ERROR_LIMIT_REACHED 5
+#define MAX_SAMPLES_PER_RECEIVER (1u << 22)                      // latency samples kept per receiver (4M)
+#define MAX_BENCH_RECEIVERS 1024
+
+/*  Configuration of one benchmark run, filled in from the command line.
+*/
+typedef struct {
+    int senders;
+    int receivers;
+    int dialogs;
+    int first_dialog;
+    long msgs_per_sender;
+    int msg_bytes;
+    long rate;                                                   // messages per second per sender, 0 = as fast as possible
+    int pingpong;                                                // -P: round trips between two processes instead
+    long stream_bytes;                                           // -S: stream payloads of this size instead, 0 = messages
+} bench_config_t;
+
+/*  Results region, mapped MAP_SHARED before forking so that every child can report into it.
+    go: start flag, raised by the parent once every child has joined its dialog (-1: the run is called off)
+    ready: number of children that have joined
+    full: number of children that found their dialog full and left
+    full_retries: how many times senders found their dialog full and had to retry
+    received / sample_count: per receiver counters, samples: per receiver latency samples (ns)
+    pingpong_slot: the slots of the two ping-pong processes, so each can address the other
+    senders_done: per dialog, the senders that have finished (see sender_done)
+*/
+typedef struct {
+    _Atomic int go;
+    _Atomic int ready;
+    _Atomic int full;
+    _Atomic int pingpong_slot[2];
+    _Atomic int senders_done[MAX_DIALOGS_LIMIT];
+    _Atomic uint64_t full_retries;
+    _Atomic uint64_t received[MAX_BENCH_RECEIVERS];
+    uint64_t sample_count[MAX_BENCH_RECEIVERS];
+} bench_results_t;
+
+static dialog_config_t shm_cfg;                                  // segment and flow-control settings (DIALOG_*)
+static shared_memory_t *shared_mem;                              // the segment, attached before forking
+
+static long parse_positive(const char *s, const char *what) {
+    char *end = NULL;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < 0) {
+        fprintf(stderr, "Error: %s must be a non-negative integer\n", what);
+        exit(ERROR_BAD_OPTION);
+    }
+    return v;
+}
+
+static void parse_options(int argc, char *argv[], bench_config_t *cfg) {
+    cfg->senders = 1;
+    cfg->receivers = 1;
+    cfg->dialogs = 1;
+    cfg->first_dialog = 0;
+    cfg->msgs_per_sender = 100000;
+    cfg->msg_bytes = 64;
+    cfg->rate = 0;
+    cfg->pingpong = 0;
+    cfg->stream_bytes = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:d:o:n:b:R:PS:")) != -1) {
+        switch (opt) {
+            case 's': cfg->senders = (int)parse_positive(optarg, "senders"); break;
+            case 'r': cfg->receivers = (int)parse_positive(optarg, "receivers"); break;
+            case 'd': cfg->dialogs = (int)parse_positive(optarg, "dialogs"); break;
+            case 'o': cfg->first_dialog = (int)parse_positive(optarg, "first dialog"); break;
+            case 'n': cfg->msgs_per_sender = parse_positive(optarg, "messages per sender"); break;
+            case 'b': cfg->msg_bytes = (int)parse_positive(optarg, "message bytes"); break;
+            case 'R': cfg->rate = parse_positive(optarg, "rate"); break;
+            case 'P': cfg->pingpong = 1; break;
+            case 'S': cfg->stream_bytes = parse_positive(optarg, "stream bytes"); break;
+            default:
+                fprintf(stderr, "Usage: %s [-s senders] [-r receivers] [-d dialogs] [-o first_dialog]\n"
+                                "       [-n msgs_per_sender] [-b msg_bytes] [-R msgs_per_sec_per_sender] [-P] [-S stream_bytes]\n", argv[0]);
+                exit(ERROR_BAD_OPTION);
+        }
+    }
+
+    if (cfg->pingpong) {                                         // one process on each side of one dialog
+        cfg->senders = 1;
+        cfg->receivers = 1;
+        cfg->dialogs = 1;
+        cfg->rate = 0;
+    }
+    if (cfg->senders < 1 || cfg->receivers < 1 || cfg->dialogs < 1 || cfg->receivers > MAX_BENCH_RECEIVERS) {
+        fprintf(stderr, "Error: need at least one sender, dialog and receiver (at most %d receivers)\n", MAX_BENCH_RECEIVERS);
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cfg->msg_bytes < 24) cfg->msg_bytes = 24;                // room for the embedded timestamp
+}
+
+/*  Checks the run against the capacities of the attached segment, which are only known once it
+    is attached. Called with the global mutex held; on failure it releases it and exits.
+*/
+static void check_capacity(bench_config_t *cfg, int shm_id) {
+    int per_dialog = (cfg->senders + cfg->dialogs - 1) / cfg->dialogs + (cfg->receivers + cfg->dialogs - 1) / cfg->dialogs;
+    const char *error = NULL;
+
+    if (cfg->first_dialog + cfg->dialogs > (int)shared_mem->max_dialogs) error = "dialogs";
+    else if (per_dialog > (int)shared_mem->max_participants) error = "participants per dialog";
+    if (error) {
+        fprintf(stderr, "Error: not enough %s in the segment (%u dialogs of %u participants)\n",
+                error, shared_mem->max_dialogs, shared_mem->max_participants);
+        detach_shared_memory(shared_mem, shm_id);
+        exit(ERROR_BAD_OPTION);
+    }
+    if (cfg->msg_bytes > (int)shared_mem->max_msg_size) cfg->msg_bytes = (int)shared_mem->max_msg_size;
+}
+
+/*  Ends a child: it stops counting as a process of the segment and detaches it.
+*/
+static void child_exit(int code) {
+    lock_counted(mutex, &shared_mem->mutex_stats);
+    unregister_process(shared_mem);
+    pthread_mutex_unlock(mutex);
+    shmdt(shared_mem);
+    _exit(code);
+}
+
+/*  Joins the dialog under its lock, the same way ./dialog does. check_capacity made sure the run has
+    enough slots, but the dialogs may already have participants of their own: a child that finds its
+    dialog full says so and exits like ./dialog, and the parent then calls the run off (see main).
+*/
+static int bench_join(bench_results_t *res, dialog_t *dialog, int dialog_id, int mode) {
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    activate_dialog(dialog, dialog_id, &shm_cfg);
+    int slot = join_dialog(dialog, getpid(), mode);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+    if (slot < 0) {
+        fprintf(stderr, "Dialog %d is full.\n", dialog_id);
+        atomic_fetch_add(&res->full, 1);
+        child_exit(ERROR_LIMIT_REACHED);
+    }
+    return slot;
+}
+
+static void bench_leave(dialog_t *dialog, int slot) {
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    leave_dialog(dialog, slot);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+}
+
+/*  Waits for the start flag. If the run was called off the child leaves its dialog and exits.
+*/
+static void wait_for_start(bench_results_t *res, dialog_t *dialog, int slot) {
+    atomic_fetch_add(&res->ready, 1);
+    while (!atomic_load(&res->go)) usleep(100);
+    if (atomic_load(&res->go) < 0) {
+        bench_leave(dialog, slot);
+        child_exit(ERROR_LIMIT_REACHED);
+    }
+}
+
+/*  Returns the number of senders that send to the given dialog.
+*/
+static int senders_in(const bench_config_t *cfg, int dialog_id) {
+    int senders_here = 0;
+    for (int i = 0; i < cfg->senders; i++) {
+        if (i % cfg->dialogs == dialog_id - cfg->first_dialog) senders_here++;
+    }
+    return senders_here;
+}
+
+/*  Called by a sender once it has sent everything: the last sender of the dialog terminates it.
+*/
+static void sender_done(const bench_config_t *cfg, bench_results_t *res, dialog_t *dialog, int dialog_id, int slot) {
+    if (atomic_fetch_add(&res->senders_done[dialog_id - cfg->first_dialog], 1) + 1 == senders_in(cfg, dialog_id)) {
+        message_control(dialog, slot, CONTROL_TERMINATE);
+    }
+}
+
+/*  Looks at the control events of the dialog that are pending for the slot. The bench only acts on
+    the terminate (see dialog_terminated), but the events have to be taken, or dialog_wait would not sleep.
+*/
+static void skip_control(dialog_t *dialog, int slot) {
+    control_event_t e;
+    while (control_next(dialog, slot, &e)) { }
+}
+
+static void run_sender(const bench_config_t *cfg, bench_results_t *res, dialog_t *dialog, int dialog_id) {
+    int slot = bench_join(res, dialog, dialog_id, SLOT_SEND_ONLY);
+    char text[MAX_MSG_SIZE + 1];
+    uint64_t retries = 0;
+
+    memset(text, 'x', sizeof(text));
+    wait_for_start(res, dialog, slot);
+
+    uint64_t interval = cfg->rate > 0 ? 1000000000ull / (uint64_t)cfg->rate : 0;
+    uint64_t next = monotonic_ns();
+
+    for (long i = 0; i < cfg->msgs_per_sender; i++) {
+        if (interval) {                                          // pace against an absolute schedule, so jitter does not accumulate
+            next += interval;
+            struct timespec ts = { (time_t)(next / 1000000000ull), (long)(next % 1000000000ull) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        int n = snprintf(text, sizeof(text), "%020" PRIu64, monotonic_ns()); // fixed-width send timestamp
+        text[n] = 'x';                                           // keep the padding after the timestamp
+        text[cfg->msg_bytes] = '\0';
+
+        while (message_send(dialog, slot, text) != 0) {         // dialog full: wait for the receivers to catch up
+            retries++;
+            dialog_notify(dialog);
+            sched_yield();
+        }
+        dialog_notify(dialog);
+    }
+
+    sender_done(cfg, res, dialog, dialog_id, slot);
+
+    atomic_fetch_add(&res->full_retries, retries);
+    bench_leave(dialog, slot);
+}
+
+static void run_receiver(bench_results_t *res, uint64_t *samples, int index, dialog_t *dialog, int dialog_id) {
+    int slot = bench_join(res, dialog, dialog_id, SLOT_READER);
+
+    wait_for_start(res, dialog, slot);
+
+    int spin_budget = 64;
+    uint64_t received = 0, kept = 0;
+    received_message_t m;
+
+    while (1) {
+        if (!message_fetch(dialog, slot, &m)) {
+            if (dialog_terminated(dialog, atomic_load(&dialog_cursors(dialog)[slot].read_seq))) break;
+            skip_control(dialog, slot);
+            dialog_wait(dialog, slot, &spin_budget);
+            continue;
+        }
+        uint64_t sent = strtoull(m.text, NULL, 10);
+        received++;
+        if (kept < MAX_SAMPLES_PER_RECEIVER) samples[kept++] = monotonic_ns() - sent;
+    }
+
+    atomic_store(&res->received[index], received);
+    res->sample_count[index] = kept;
+    bench_leave(dialog, slot);
+}
+
+static void run_stream_sender(const bench_config_t *cfg, bench_results_t *res, dialog_t *dialog, int dialog_id) {
+    int slot = bench_join(res, dialog, dialog_id, SLOT_SEND_ONLY);
+    char *payload = malloc((size_t)cfg->stream_bytes);
+    if (payload == NULL) {
+        perror("malloc");
+        _exit(errno);
+    }
+    memset(payload, 'x', (size_t)cfg->stream_bytes);
+    uint64_t retries = 0;
+    wait_for_start(res, dialog, slot);
+
+    for (long i = 0; i < cfg->msgs_per_sender; i++) {
+        while (message_send_stream(dialog, slot, (uint32_t)i + 1, payload, (uint64_t)cfg->stream_bytes,
+                                   NULL, shm_cfg.stream_window) != 0) retries++; // block timeout: send it again
+    }
+
+    sender_done(cfg, res, dialog, dialog_id, slot);
+
+    atomic_fetch_add(&res->full_retries, retries);
+    free(payload);
+    bench_leave(dialog, slot);
+}
+
+/*  Receives streams like a libdialog program: every fragment is looked at in place with message_peek,
+    copied to its offset in the buffer and released at once, so the window of the sender keeps moving.
+*/
+static void run_stream_receiver(const bench_config_t *cfg, bench_results_t *res, uint64_t *samples,
+                                int index, dialog_t *dialog, int dialog_id) {
+    int slot = bench_join(res, dialog, dialog_id, SLOT_READER);
+    char *buffer = malloc((size_t)cfg->stream_bytes);
+    if (buffer == NULL) {
+        perror("malloc");
+        _exit(errno);
+    }
+    memset(buffer, 0, (size_t)cfg->stream_bytes);                // fault it in before the clock starts
+    wait_for_start(res, dialog, slot);
+
+    int spin_budget = 64;
+    uint64_t cursor = 0, streams = 0, kept = 0;
+    uint64_t started[MAX_DIALOG_PARTICIPANTS] = { 0 };           // sent_ns of the first fragment, per sender
+    message_view_t v;
+
+    while (1) {
+        if (!message_peek(dialog, slot, &cursor, &v)) {
+            if (dialog_terminated(dialog, cursor)) break;
+            skip_control(dialog, slot);
+            dialog_wait(dialog, slot, &spin_budget);             // every view is released, so the read cursor is ours
+            continue;
+        }
+        if (v.stream_id != 0 && v.stream_offset + v.length <= (uint64_t)cfg->stream_bytes) {
+            if (v.stream_offset == 0) started[v.sender_slot] = v.sent_ns;
+            memcpy(buffer + v.stream_offset, v.data, v.length);
+            if (v.stream_offset + v.length == v.stream_length) {
+                streams++;
+                if (kept < MAX_SAMPLES_PER_RECEIVER) samples[kept++] = monotonic_ns() - started[v.sender_slot];
+            }
+        }
+        message_release(dialog, slot, &v);
+    }
+
+    atomic_store(&res->received[index], streams);
+    res->sample_count[index] = kept;
+    free(buffer);
+    bench_leave(dialog, slot);
+}
+
+/*  Pins the calling process to the n-th CPU it may run on, if there is one, so the two sides of the
+    ping-pong run on different cores.
+*/
+static void pin_to_cpu(int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) < 2) return;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n-- > 0) continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        sched_setaffinity(0, sizeof(one), &one);
+        return;
+    }
+}
+
+/*  One side of the ping-pong. Side 0 sends and waits for the answer, timing each round trip;
+    side 1 answers every message it gets. Both spin as long as dialog_wait lets them.
+*/
+static void run_pingpong(const bench_config_t *cfg, bench_results_t *res, uint64_t *samples,
+                         int side, dialog_t *dialog, int dialog_id) {
+    pin_to_cpu(side);
+    int slot = bench_join(res, dialog, dialog_id, SLOT_READER);
+    atomic_store(&res->pingpong_slot[side], slot);
+    wait_for_start(res, dialog, slot);
+    slot_set_t peer = { { 0 } };
+    slot_set_add(&peer, atomic_load(&res->pingpong_slot[1 - side])); // directed, so nobody reads its own message
+
+    char text[MAX_MSG_SIZE + 1];
+    memset(text, 'x', sizeof(text));
+    text[cfg->msg_bytes] = '\0';
+
+    int spin_budget = MAX_SPIN_ITERATIONS;
+    uint64_t kept = 0;
+    received_message_t m;
+
+    for (long i = 0; i < cfg->msgs_per_sender; i++) {
+        uint64_t start = monotonic_ns();
+        if (side == 0) {
+            while (message_send_to(dialog, slot, text, &peer) != 0) sched_yield();
+            dialog_notify(dialog);
+        }
+        while (!message_fetch(dialog, slot, &m)) {
+            skip_control(dialog, slot);
+            dialog_wait(dialog, slot, &spin_budget);
+        }
+        if (side == 1) {
+            while (message_send_to(dialog, slot, text, &peer) != 0) sched_yield();
+            dialog_notify(dialog);
+        }
+        else if (kept < MAX_SAMPLES_PER_RECEIVER) samples[kept++] = monotonic_ns() - start;
+    }
+
+    if (side == 0) {
+        atomic_store(&res->received[0], kept);
+        res->sample_count[0] = kept;
+    }
+    bench_leave(dialog, slot);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, uint64_t n, double p) {
+    if (n == 0) return 0;
+    uint64_t i = (uint64_t)(p * (double)(n - 1));
+    return sorted[i];
+}
+
+int main(int argc, char *argv[]) {
+    bench_config_t cfg;
+    parse_options(argc, argv, &cfg);
+
+    load_config(&shm_cfg);
+
+    int shm_id = -1;
+    shared_mem = attach_and_lock_shared_mem(&shm_cfg, &shm_id);
+
+    // The parent and every child count as processes of the segment, exactly like ./dialog,
+    // so the segment is removed by whoever leaves last, bench or not.
+    if (!shared_mem->is_initialized) init_shared_memory(shared_mem, &shm_cfg, shm_id);
+    check_layout(shared_mem, shm_id, -1);
+    check_capacity(&cfg, shm_id);
+    shared_mem->total_processes += 1 + cfg.senders + cfg.receivers;
+    pthread_mutex_unlock(mutex);
+
+    size_t samples_size = (size_t)cfg.receivers * MAX_SAMPLES_PER_RECEIVER * sizeof(uint64_t);
+    bench_results_t *res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    uint64_t *samples = mmap(NULL, samples_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (res == MAP_FAILED || samples == MAP_FAILED) {
+        perror("mmap");
+        exit(errno);
+    }
+
+    int children = cfg.senders + cfg.receivers;
+    for (int c = 0; c < children; c++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(errno);
+        }
+        if (pid > 0) continue;
+
+        int is_sender = c < cfg.senders;
+        int index = is_sender ? c : c - cfg.senders;
+        int dialog_id = cfg.first_dialog + index % cfg.dialogs;
+        dialog_t *dialog = prepare_dialog(shared_mem, dialog_id);
+
+        if (cfg.pingpong) run_pingpong(&cfg, res, samples, c, dialog, dialog_id);
+        else if (cfg.stream_bytes && is_sender) run_stream_sender(&cfg, res, dialog, dialog_id);
+        else if (cfg.stream_bytes) run_stream_receiver(&cfg, res, samples + (size_t)index * MAX_SAMPLES_PER_RECEIVER, index, dialog, dialog_id);
+        else if (is_sender) run_sender(&cfg, res, dialog, dialog_id);
+        else run_receiver(res, samples + (size_t)index * MAX_SAMPLES_PER_RECEIVER, index, dialog, dialog_id);
+
+        child_exit(0);
+    }
+
+    // Every child has joined its dialog, or found it full. A single full dialog calls the whole run off:
+    // the numbers would not mean anything, and its receivers would wait for senders that never come.
+    while (atomic_load(&res->ready) + atomic_load(&res->full) < children) usleep(100);
+    if (atomic_load(&res->full)) {
+        atomic_store(&res->go, -1);
+        for (int c = 0; c < children; c++) wait(NULL);
+        fprintf(stderr, "Error: %d of the bench processes found their dialog full, run called off\n",
+                atomic_load(&res->full));
+        lock_counted(mutex, &shared_mem->mutex_stats);
+        unregister_process(shared_mem);
+        detach_shared_memory(shared_mem, shm_id);
+        exit(ERROR_LIMIT_REACHED);
+    }
+    uint64_t start = monotonic_ns();
+    atomic_store(&res->go, 1);
+
+    for (int c = 0; c < children; c++) wait(NULL);
+    double seconds = (double)(monotonic_ns() - start) / 1e9;
+
+    // Merge the samples of all receivers and report.
+    uint64_t delivered = 0, total_samples = 0;
+    for (int r = 0; r < cfg.receivers; r++) {
+        delivered += atomic_load(&res->received[r]);
+        memmove(samples + total_samples, samples + (size_t)r * MAX_SAMPLES_PER_RECEIVER,
+                res->sample_count[r] * sizeof(uint64_t));
+        total_samples += res->sample_count[r];
+    }
+    qsort(samples, total_samples, sizeof(uint64_t), compare_u64);
+
+    uint64_t sent = (uint64_t)cfg.senders * (uint64_t)cfg.msgs_per_sender;
+    if (cfg.pingpong) {
+        printf("bench: ping-pong, %ld round trips, %d bytes/msg\n", cfg.msgs_per_sender, cfg.msg_bytes);
+        printf("elapsed:    %.3f s, %.0f round trips/s\n", seconds, (double)delivered / seconds);
+        printf("rtt ns:     p50 %" PRIu64 "  p99 %" PRIu64 "  p999 %" PRIu64 "  max %" PRIu64 "\n",
+               percentile(samples, total_samples, 0.50), percentile(samples, total_samples, 0.99),
+               percentile(samples, total_samples, 0.999), total_samples ? samples[total_samples - 1] : 0);
+    }
+    else if (cfg.stream_bytes) {
+        printf("bench: %d senders, %d receivers, %d dialogs, %ld streams/sender of %ld bytes\n",
+               cfg.senders, cfg.receivers, cfg.dialogs, cfg.msgs_per_sender, cfg.stream_bytes);
+        printf("elapsed:    %.3f s\n", seconds);
+        printf("delivered:  %" PRIu64 " streams, %.1f MB/s\n", delivered,
+               (double)delivered * (double)cfg.stream_bytes / seconds / 1e6);
+        printf("stream ns:  p50 %" PRIu64 "  p99 %" PRIu64 "  max %" PRIu64 "\n",
+               percentile(samples, total_samples, 0.50), percentile(samples, total_samples, 0.99),
+               total_samples ? samples[total_samples - 1] : 0);
+        printf("timed-out streams resent: %" PRIu64 "\n", atomic_load(&res->full_retries));
+    }
+    else {
+        printf("bench: %d senders, %d receivers, %d dialogs, %ld msgs/sender, %d bytes/msg, rate %ld/s/sender\n",
+               cfg.senders, cfg.receivers, cfg.dialogs, cfg.msgs_per_sender, cfg.msg_bytes, cfg.rate);
+        printf("elapsed:    %.3f s\n", seconds);
+        printf("sent:       %" PRIu64 " msgs, %.0f msgs/s\n", sent, (double)sent / seconds);
+        printf("delivered:  %" PRIu64 " msgs, %.0f msgs/s\n", delivered, (double)delivered / seconds);
+        printf("latency ns: p50 %" PRIu64 "  p99 %" PRIu64 "  p999 %" PRIu64 "  max %" PRIu64 "\n",
+               percentile(samples, total_samples, 0.50), percentile(samples, total_samples, 0.99),
+               percentile(samples, total_samples, 0.999), total_samples ? samples[total_samples - 1] : 0);
+        printf("full-dialog retries: %" PRIu64 "\n", atomic_load(&res->full_retries));
+    }
+
+    munmap(samples, samples_size);
+    munmap(res, sizeof(*res));
+
+    // Leave like the last ./dialog would: the last process removes the segment and the mutex.
+    lock_counted(mutex, &shared_mem->mutex_stats);
+    unregister_process(shared_mem);
+    detach_shared_memory(shared_mem, shm_id);
+    return 0;
+}
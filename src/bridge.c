@@ -0,0 +1,473 @@
+/* bridge.c
+    Socket bridge between two instances of the messaging system. A dialog lives in one shared memory
+    segment, so it is limited to the processes of one host (or one DIALOG_SHM_KEY). ./dialogbridge
+    joins a dialog of its segment as an ordinary participant and relays the traffic of that dialog
+    over a TCP or Unix-domain socket to a bridge attached to another segment, in both directions, so
+    that the two dialogs behave like one.
+
+    Usage: ./dialogbridge [-l] [-H max_hops] <dialog_ID> <address>
+    address is unix:<path> for a Unix-domain socket or <host>:<port> for TCP. With -l the bridge
+    listens on address and serves the first peer that connects; otherwise it connects to it.
+
+    Messages are relayed in frames: the outbound thread takes every message that is pending in the
+    dialog, up to FRAME_SIZE bytes, and sends them with one write; the inbound thread publishes the
+    messages of a frame with one reservation in the ring. A message is not relayed back to where it
+    came from: the bridge never sends on what it has published itself, and every message counts the
+    bridges it has crossed (message_t.hops), so that in a cycle of bridges it stops after max_hops.
+    Stream fragments are not relayed, and neither are directed messages, since slots are local to a
+    segment, except the ones addressed to the slot of the bridge: "@<slot of the bridge> text" sends
+    text to the other side only.
+
+    Control events (see control_event_t) are relayed too, as records without a text: flushes, pauses
+    and resumes at once, a terminate after the messages sent before it. Joins and leaves are local.
+    The bridge ends once the dialog is terminated, from either side, or when the peer closes the connection.
+*/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/dialog.h"
+
+#define ERROR_BAD_OPTION 1
+#define ERROR_SOCKET 2
+#define ERROR_LIMIT_REACHED 5
+
+#define BRIDGE_MAGIC 0x44424731u                                 // "DBG1", starts every frame
+#define FRAME_SIZE (64 * 1024)                                   // bytes of records in one frame at most
+#define DEFAULT_MAX_HOPS 4
+#define SPACE_WAIT_SLICE_MS 10                                   // longest sleep while the dialog is full
+
+/*  The wire format. Every field is sent big-endian.
+    frame_header_t: BRIDGE_MAGIC, the number of records that follow and their size in bytes.
+    frame_record_t: one message: the length of its text, which follows the record, and the number
+    of bridges it has crossed, the one that sent it included. control is 0 for a message; a record
+    with the kind of a control event in it stands for that event and has no text: its length is 0.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t bytes;
+} frame_header_t;
+
+typedef struct {
+    uint32_t length;
+    uint16_t hops;
+    uint16_t control;
+} frame_record_t;
+
+_Static_assert(FRAME_SIZE >= sizeof(frame_record_t) + MAX_MSG_SIZE, "a whole message must fit in a frame");
+
+/*  The state shared by the two relay threads.
+    member: the dialog and the slot of the bridge in it. The outbound thread reads it with message_peek.
+    sock: the connected socket
+    max_hops: a message that has crossed this many bridges is not relayed any further
+    stop: raised by the thread that ends first, so that the other one ends too
+*/
+typedef struct {
+    membership_t member;
+    int sock;
+    uint32_t max_hops;
+    _Atomic int stop;
+} bridge_t;
+
+static char out_frame[sizeof(frame_header_t) + FRAME_SIZE];      // one buffer per relay thread
+static char in_frame[FRAME_SIZE];
+
+/*  Sends the whole buffer on the socket. It returns 0, or -1 once the peer is gone.
+*/
+static int send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);          // a closed peer is an error, not a SIGPIPE
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*  Receives exactly len bytes from the socket. It returns 0, or -1 at the end of the connection.
+*/
+static int recv_all(int sock, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*  Packs the control events that the bridge has not looked at yet into the frame, after the used bytes,
+    while there is room. Flushes, pauses and resumes are relayed unless the bridge posted them itself or
+    they have crossed max_hops bridges. A terminate is relayed by outbound_thread, after the messages
+    sent before it; its hops are kept in *terminate_hops. It returns the number of records packed.
+*/
+static uint32_t pack_control(bridge_t *b, size_t *used, uint32_t *terminate_hops) {
+    uint32_t count = 0;
+    control_event_t e;
+    while (*used + 2 * sizeof(frame_record_t) <= sizeof(out_frame) && // one more stays free for the terminate
+           control_next(b->member.dialog, b->member.my_slot, &e)) {
+        if (e.kind == CONTROL_TERMINATE) *terminate_hops = e.hops;
+        if (e.kind < CONTROL_FLUSH || e.kind > CONTROL_RESUME) continue;
+        if (e.slot == b->member.my_slot || e.hops >= b->max_hops) continue;
+
+        frame_record_t rec = { 0, htons((uint16_t)(e.hops + 1)), htons((uint16_t)e.kind) };
+        memcpy(out_frame + *used, &rec, sizeof(rec));
+        *used += sizeof(rec);
+        count++;
+    }
+    return count;
+}
+
+/*  Relays the dialog to the peer. Everything pending is packed into one frame; the messages are
+    acknowledged only once the frame has been written, so a slow peer holds them back like a slow
+    reader would, and the flow-control policy of the dialog applies to the bridge too.
+*/
+static void* outbound_thread(void *arg) {
+    bridge_t *b = arg;
+    dialog_t *dialog = b->member.dialog;
+    int spin_budget = MAX_SPIN_ITERATIONS;
+    uint32_t terminate_hops = 0;
+    int terminate = 0;
+
+    while (!terminate && !atomic_load(&b->stop)) {
+        size_t used = sizeof(frame_header_t);
+        uint32_t count = pack_control(b, &used, &terminate_hops); // control events go first, as for every reader
+        int have = 0;
+        message_view_t v, last;
+
+        while (used + sizeof(frame_record_t) + MAX_MSG_SIZE <= sizeof(out_frame) &&
+               !atomic_load_explicit(&dialog->paused, memory_order_relaxed)) {
+            if (dialog_terminated(dialog, b->member.view_seq)) {
+                terminate = 1;
+                break;
+            }
+            if (!message_peek(dialog, b->member.my_slot, &b->member.view_seq, &v)) break;
+            last = v;
+            have = 1;
+            if (dialog_terminated(dialog, v.seq)) continue;      // sent after the terminate: the loop ends here
+            if (v.sender_slot == b->member.my_slot || v.stream_id != 0 || v.hops >= b->max_hops) continue; // ours, or not relayed
+
+            frame_record_t rec = { htonl(v.length), htons((uint16_t)(v.hops + 1)), 0 };
+            memcpy(out_frame + used, &rec, sizeof(rec));
+            memcpy(out_frame + used + sizeof(rec), v.data, v.length);
+            used += sizeof(rec) + v.length;
+            count++;
+        }
+        if (terminate) {                                         // everything before it is in the frame
+            count += pack_control(b, &used, &terminate_hops);    // its event may still be pending
+            if (dialog->terminate_slot != b->member.my_slot && terminate_hops < b->max_hops) {
+                frame_record_t rec = { 0, htons((uint16_t)(terminate_hops + 1)), htons(CONTROL_TERMINATE) };
+                memcpy(out_frame + used, &rec, sizeof(rec));
+                used += sizeof(rec);
+                count++;
+            }
+        }
+
+        if (count > 0) {
+            frame_header_t h = { htonl(BRIDGE_MAGIC), htonl(count), htonl((uint32_t)(used - sizeof(h))) };
+            memcpy(out_frame, &h, sizeof(h));
+            if (send_all(b->sock, out_frame, used) != 0) break;
+        }
+        if (have) message_release(dialog, b->member.my_slot, &last); // covers every earlier view as well
+        if (have || terminate) continue;                         // the terminate may follow no message at all
+        dialog_wait_any(&b->member, 1, &spin_budget);
+    }
+
+    atomic_store(&b->stop, 1);
+    shutdown(b->sock, SHUT_RDWR);                                // the peer sees the end of the stream, our inbound thread too
+    return NULL;
+}
+
+/*  Publishes count relayed messages in order. While the dialog is full it waits for room, as the
+    writer thread of ./dialog does, and gives up on the rest after the block timeout of the dialog.
+    It returns early if the bridge is stopping.
+*/
+static void relay_messages(bridge_t *b, const char **texts, uint32_t *lens, uint32_t *hops, int count) {
+    dialog_t *dialog = b->member.dialog;
+    uint64_t full_since = 0;
+    int sent = 0;
+
+    while (sent < count) {
+        uint32_t seen = atomic_load(&dialog->space_word);         // read before trying, so no wakeup is missed
+        int n = message_relay_batch(dialog, b->member.my_slot, texts + sent, lens + sent, hops + sent, count - sent);
+        if (n < 0) {                                             // can never be published, waiting would not help
+            fprintf(stderr, "Dialog %d can not hold a relayed message of %u bytes, dropped\n", b->member.dialog_id, lens[sent]);
+            sent++;
+            continue;
+        }
+        sent += n;
+        dialog_notify(dialog);
+        if (n > 0) {
+            full_since = 0;
+            continue;
+        }
+
+        if (atomic_load(&b->stop)) return;
+        uint64_t now = monotonic_ns();
+        if (full_since == 0) full_since = now;
+        if (dialog->block_timeout_ms && now - full_since >= (uint64_t)dialog->block_timeout_ms * 1000000u) {
+            stat_add(&dialog_slot_stats(dialog)[b->member.my_slot].timed_out, (uint64_t)(count - sent));
+            fprintf(stderr, "Dialog %d stayed full for %u ms, %d relayed message(s) dropped\n",
+                    b->member.dialog_id, dialog->block_timeout_ms, count - sent);
+            return;
+        }
+        dialog_wait_space(dialog, seen, SPACE_WAIT_SLICE_MS);
+    }
+}
+
+/*  Relays the peer to the dialog, one frame at a time. A message longer than the message size of
+    this segment (the peer may have been created with a larger one) is published in pieces. A control
+    event is posted once the messages before it in the frame are published. A control record with a
+    length would leave the rest of the frame unparsable, so the connection is dropped on one.
+*/
+static void* inbound_thread(void *arg) {
+    bridge_t *b = arg;
+    uint32_t max_len = b->member.dialog->max_msg_size;
+    const char *texts[MAX_SEND_BATCH];
+    uint32_t lens[MAX_SEND_BATCH];
+    uint32_t hops[MAX_SEND_BATCH];
+
+    while (!atomic_load(&b->stop)) {
+        frame_header_t h;
+        if (recv_all(b->sock, (char*)&h, sizeof(h)) != 0) break;
+        uint32_t count = ntohl(h.count), bytes = ntohl(h.bytes);
+        if (ntohl(h.magic) != BRIDGE_MAGIC || bytes > FRAME_SIZE) {
+            fprintf(stderr, "Bridge: the peer sent a frame this bridge does not understand, closing\n");
+            break;
+        }
+        if (recv_all(b->sock, in_frame, bytes) != 0) break;
+
+        int n = 0, bad = 0;
+        size_t at = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            frame_record_t rec;
+            if (bytes - at < sizeof(rec)) break;
+            memcpy(&rec, in_frame + at, sizeof(rec));
+            uint32_t length = ntohl(rec.length);
+            uint16_t control = ntohs(rec.control);
+            at += sizeof(rec);
+            if (length > bytes - at) break;                      // a truncated record ends the frame
+
+            if (control != 0 && length != 0) {                   // a control record has no text
+                bad = 1;
+                break;
+            }
+            if (control != 0) {
+                if (n > 0) relay_messages(b, texts, lens, hops, n);
+                n = 0;
+                if (control >= CONTROL_TERMINATE && control <= CONTROL_RESUME) {
+                    message_relay_control(b->member.dialog, b->member.my_slot, control, ntohs(rec.hops));
+                }
+                continue;
+            }
+
+            for (uint32_t piece = 0; piece < length; piece += max_len) {
+                if (n == MAX_SEND_BATCH) {
+                    relay_messages(b, texts, lens, hops, n);
+                    n = 0;
+                }
+                texts[n] = in_frame + at + piece;
+                lens[n] = length - piece < max_len ? length - piece : max_len;
+                hops[n] = ntohs(rec.hops);
+                n++;
+            }
+            at += length;
+        }
+        if (n > 0) relay_messages(b, texts, lens, hops, n);      // the records before a bad one still count
+        if (bad) {
+            fprintf(stderr, "Bridge: the peer sent a control record with text, closing\n");
+            break;
+        }
+    }
+
+    atomic_store(&b->stop, 1);
+    dialog_notify(b->member.dialog);                             // wakes the outbound thread if it sleeps
+    return NULL;
+}
+
+/*  Listens on or connects to address (see the usage above) and returns the connected socket.
+    A Unix-domain listener replaces a socket file left behind at its path.
+*/
+static int open_connection(const char *address, int listening) {
+    int sock = -1;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Error: socket path too long: %s\n", address + 5);
+            exit(ERROR_BAD_OPTION);
+        }
+        strcpy(sun.sun_path, address + 5);
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        if (listening) {
+            unlink(sun.sun_path);
+            if (bind(sock, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(sock, 1) != 0) return -1;
+        }
+        else if (connect(sock, (struct sockaddr*)&sun, sizeof(sun)) != 0) return -1;
+    }
+    else {
+        char host[256];
+        const char *colon = strrchr(address, ':');
+        if (colon == NULL || (size_t)(colon - address) >= sizeof(host) || colon[1] == '\0') {
+            fprintf(stderr, "Error: address must be unix:<path> or <host>:<port>\n");
+            exit(ERROR_BAD_OPTION);
+        }
+        memcpy(host, address, (size_t)(colon - address));
+        host[colon - address] = '\0';
+
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        int rc = getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &found);
+        if (rc != 0) {
+            fprintf(stderr, "Error: %s: %s\n", address, gai_strerror(rc));
+            exit(ERROR_SOCKET);
+        }
+        for (struct addrinfo *ai = found; ai != NULL; ai = ai->ai_next) {
+            sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sock < 0) continue;
+            int on = 1;
+            if (listening) {
+                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 && listen(sock, 1) == 0) break;
+            }
+            else if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // frames are batched already
+                break;
+            }
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(found);
+        if (sock < 0) return -1;
+    }
+
+    if (!listening) return sock;
+    int peer = accept(sock, NULL, NULL);
+    close(sock);
+    if (peer >= 0) {
+        int on = 1;
+        setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly on a Unix-domain socket
+    }
+    return peer;
+}
+
+int main(int argc, char *argv[]) {
+    int listening = 0;
+    long max_hops = DEFAULT_MAX_HOPS;
+    int opt;
+    while ((opt = getopt(argc, argv, "lH:")) != -1) {
+        switch (opt) {
+            case 'l': listening = 1; break;
+            case 'H': max_hops = strtol(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-H max_hops] <dialog_ID> <address>\n", argv[0]);
+                exit(ERROR_BAD_OPTION);
+        }
+    }
+    if (argc - optind != 2 || max_hops < 1 || max_hops > 255) {
+        fprintf(stderr, "Usage: %s [-l] [-H max_hops (1..255)] <dialog_ID> <address>\n", argv[0]);
+        exit(ERROR_BAD_OPTION);
+    }
+    char *end;
+    long dialog_id = strtol(argv[optind], &end, 10);
+    if (*end != '\0' || dialog_id < 0 || dialog_id >= MAX_DIALOGS_LIMIT) {
+        fprintf(stderr, "Error: <dialog_ID> must be a number between 0 and %d\n", MAX_DIALOGS_LIMIT - 1);
+        exit(ERROR_BAD_OPTION);
+    }
+
+    // The peer comes first: until it is there, a joined bridge would only hold messages back.
+    bridge_t b;
+    b.sock = open_connection(argv[optind + 1], listening);
+    if (b.sock < 0) {
+        perror(argv[optind + 1]);
+        exit(ERROR_SOCKET);
+    }
+    b.max_hops = (uint32_t)max_hops;
+    atomic_store(&b.stop, 0);
+
+    // Then the dialog, which the bridge joins like ./dialog does (see dialog.c).
+    dialog_config_t cfg;
+    load_config(&cfg);
+    int shm_id = -1;
+    shared_memory_t *shared_mem = attach_and_lock_shared_mem(&cfg, &shm_id);
+    if (!shared_mem->is_initialized) init_shared_memory(shared_mem, &cfg, shm_id);
+    check_layout(shared_mem, shm_id, (int)dialog_id);
+    shared_mem->total_processes++;
+    pthread_mutex_unlock(mutex);
+
+    dialog_t *dialog = prepare_dialog(shared_mem, (int)dialog_id);
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    activate_dialog(dialog, (int)dialog_id, &cfg);
+    int my_slot = join_dialog(dialog, getpid(), SLOT_READER);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+    if (my_slot < 0) {
+        fprintf(stderr, "Dialog %ld is full.\n", dialog_id);
+        lock_counted(mutex, &shared_mem->mutex_stats);
+        unregister_process(shared_mem);
+        detach_shared_memory(shared_mem, shm_id);
+        exit(ERROR_LIMIT_REACHED);
+    }
+    journal_open(dialog);                                        // keep the mapping off the send path, if it has a journal
+
+    b.member.dialog = dialog;
+    b.member.dialog_id = (int)dialog_id;
+    b.member.my_slot = my_slot;
+    b.member.active = 1;
+    b.member.zero_copy = 1;
+    b.member.view_seq = atomic_load(&dialog_cursors(dialog)[my_slot].read_seq);
+    b.member.latency = NULL;
+    fprintf(stderr, "Bridging dialog %ld (slot %d) with %s\n", dialog_id, my_slot, argv[optind + 1]);
+
+    // The journal thread writes what the cleanup staged into the journal, as in ./dialog.
+    volatile sig_atomic_t journal_done = 0;
+    thread_args_t journal_args = { .shared_mem = shared_mem, .dialog = dialog, .dialog_id = (int)dialog_id,
+                                   .my_slot = my_slot, .members = &b.member, .member_count = 1,
+                                   .shm_id = shm_id, .terminate_flag = &journal_done };
+    int journaling = dialog->journal_enabled;
+
+    pthread_t outbound_tid, inbound_tid, journal_tid;
+    if (pthread_create(&outbound_tid, NULL, outbound_thread, &b) != 0 ||
+        pthread_create(&inbound_tid, NULL, inbound_thread, &b) != 0 ||
+        (journaling && pthread_create(&journal_tid, NULL, journal_thread, &journal_args) != 0)) {
+        perror("pthread_create");
+        exit(errno);
+    }
+    pthread_join(outbound_tid, NULL);
+    pthread_join(inbound_tid, NULL);
+    if (journaling) {
+        journal_done = 1;
+        pthread_join(journal_tid, NULL);
+    }
+    close(b.sock);
+    if (listening && strncmp(argv[optind + 1], "unix:", 5) == 0) unlink(argv[optind + 1] + 5);
+
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    leave_dialog(dialog, my_slot);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+
+    lock_counted(mutex, &shared_mem->mutex_stats);
+    unregister_process(shared_mem);
+    detach_shared_memory(shared_mem, shm_id);
+    return 0;
+}
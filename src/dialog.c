@@ -1,81 +1,157 @@
 /* dialog.c */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "../include/dialog.h"
 
+#define ERROR_LIMIT_REACHED 5
+
+static latency_t latencies[MAX_JOINED_DIALOGS];                  // latency histograms of our reader, one per dialog
+
 int main(int argc, char *argv[]) {
 
-    // At first we need to check the validity of the input arguments.
-    int dialog_id = check_argument_validity(argc, argv);
+    // At first we need to check the validity of the input arguments: the ids of the dialogs to join.
+    int ids[MAX_JOINED_DIALOGS];
+    int count = check_argument_validity(argc, argv, ids);
+
+    // The capacities of the segment and its key come from the environment (DIALOG_* variables).
+    dialog_config_t cfg;
+    load_config(&cfg);
 
     // Create and attach shared memory, we get back shm_id for future cleanup.
+    // The global 'mutex', which works as an inter-process lock, lives in the segment itself and
+    // protects it from simultaneous modification. We get the segment back with the mutex held:
+    // critical section, because we are going to modify global shared state.
     int shm_id = -1;
-    shared_memory_t *shared_mem = create_and_attach_shared_mem(&shm_id);
-
-    // Create and open semaphore 'mutex' which works as an inter-process lock.
-    // This will protect the shared memory from simultaneous modification.
-    mutex = sem_open("/mutex", O_CREAT, 0666, 1);
-    if (mutex == SEM_FAILED) {
-        perror("sem_open /mutex");
-        exit(errno);
-    }
-
-    // Critical section, because we are going to modify shared parts of memory: wait for mutex semaphore
-    sem_wait(mutex);
+    shared_memory_t *shared_mem = attach_and_lock_shared_mem(&cfg, &shm_id);
 
     // If the shared memory hasn't yet been initialized we initialize it only once.
     // The mutex semaphore ensures that there won't be 2+ simultaneous initializations
     // from different processes, which will cause corruption.
 
     if (!shared_mem->is_initialized) {
-        init_shared_memory(shared_mem);
+        init_shared_memory(shared_mem, &cfg, shm_id);
     }
 
-    // We spot the dialog with <dialog_ID> and if it is not active we make it active.
-    // This happens inside the same critical section, ensuring that the state is consistent
-    // if many processes enter.
+    // Whoever initialized the segment chose its capacities, so only now we can tell whether
+    // the segment is usable by this build and whether every <dialog_ID> exists in it.
 
-    dialog_t *dialog = &shared_mem->dialogs[dialog_id];
-    if (!dialog->is_active) {
-        dialog->is_active = 1;
-        dialog->dialog_id = dialog_id;
-    }
+    for (int i = 0; i < count; i++) check_layout(shared_mem, shm_id, ids[i]);
+
+    // We register the process globally before touching any dialog, once per dialog, because the
+    // reaper unregisters a dead process once for every slot it held. As long as total_processes
+    // is not 0, no other process will run the global cleanup and destroy the per-dialog locks.
+
+    shared_mem->total_processes += count;
 
+    // End of the global critical section. From here on only our own dialogs are touched,
+    // so processes that join other dialogs never wait for us.
+    pthread_mutex_unlock(mutex);
+
+    // We spot each dialog with a <dialog_ID> and if it is not active we make it active, with the
+    // flow-control policy of our environment (DIALOG_BACKPRESSURE).
+    // This happens under the lock of that dialog only, ensuring that the state is consistent
+    // if many processes enter the same dialog, while other dialogs proceed in parallel.
     // The calling process enters the dialog with 'join_dialog' and gets a slot inside it.
-    // This data is all shared among processes, which is why this too needs to happen inside a mutex.
+    // This data is shared among the processes of the dialog, which is why this too needs the dialog lock.
+
+    membership_t members[MAX_JOINED_DIALOGS];
+    int joined = 0;
+    for (; joined < count; joined++) {
+        dialog_t *dialog = prepare_dialog(shared_mem, ids[joined]);
+        lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+        activate_dialog(dialog, ids[joined], &cfg);
+        int my_slot = join_dialog(dialog, getpid(), SLOT_READER);
+        pthread_mutex_unlock(&dialog->dialog_lock);
+
+        if (my_slot < 0) break;
+        members[joined].dialog = dialog;
+        members[joined].dialog_id = ids[joined];
+        members[joined].my_slot = my_slot;
+        members[joined].active = 1;
+        members[joined].zero_copy = 0;
+        members[joined].view_seq = 0;
+        members[joined].latency = &latencies[joined];
+    }
 
-    int my_slot = join_dialog(dialog, getpid());
-    shared_mem->total_processes++;
+    // A full dialog is reported only now, so that no lock is held when we exit and
+    // the other processes are not affected by our departure. The dialogs joined before it are left again.
+
+    if (joined < count) {
+        fprintf(stderr, "Dialog %d is full.\n", ids[joined]);
+        for (int i = 0; i < joined; i++) {
+            lock_counted(&members[i].dialog->dialog_lock, &members[i].dialog->stats.lock);
+            leave_dialog(members[i].dialog, members[i].my_slot);
+            pthread_mutex_unlock(&members[i].dialog->dialog_lock);
+        }
+        lock_counted(mutex, &shared_mem->mutex_stats);
+        for (int i = 0; i < count; i++) unregister_process(shared_mem);
+        detach_shared_memory(shared_mem, shm_id);
+        exit(ERROR_LIMIT_REACHED);
+    }
 
-    // End of critical section because the state of the dialog and the entry 
-    // of the participant are solidified: mutex semaphore posts it
-    sem_post(mutex);
+    // If a dialog keeps a journal we map it now, so the cleanup never maps it in the middle of a send.
+    // A process that asked for a replay (DIALOG_REPLAY_FROM) first prints the journaled messages from
+    // that sequence number up to its read cursor: those have already left the ring, while the reader
+    // thread starts at the cursor, so the two together show every message once and in order.
+
+    int journaling = 0;
+    for (int i = 0; i < count; i++) {
+        dialog_t *dialog = members[i].dialog;
+        if (journal_open(dialog) != 0) continue;
+        journaling = 1;
+        if (!cfg.replay) continue;
+
+        received_message_t msg;
+        uint64_t pos = journal_seek(dialog, cfg.replay_from);
+        uint64_t cursor = atomic_load(&dialog_cursors(dialog)[members[i].my_slot].read_seq);
+        while (journal_read(dialog, &pos, cursor, &msg)) {
+            printf("[dialog %d] (slot %d, pid %d): %s\n", ids[i], msg.sender_slot, (int)msg.sender_pid, msg.text);
+        }
+        fflush(stdout);
+    }
 
-    // At this point the process with id <pid> has joined the dialog with id <dialog_ID>
+    // At this point the process with id <pid> has joined the dialogs with id <dialog_ID>
     // We now need to create 2 threads, one for reading and one for writing. These threads
-    // need to take in as arguments: the shared memory region, the designated dialog, its 
-    // dialog_id, and at last the slot in which the process was put in during the last segment.
+    // need to take in as arguments: the shared memory region, the designated dialogs, their
+    // dialog_ids, and at last the slots in which the process was put in during the last segment.
+    // A single reader follows all the dialogs, so the thread count does not grow with them.
 
     thread_args_t args;
     args.shared_mem = shared_mem;
-    args.dialog = dialog;
-    args.dialog_id = dialog_id;
-    args.my_slot = my_slot;
+    args.dialog = members[0].dialog;
+    args.dialog_id = members[0].dialog_id;
+    args.my_slot = members[0].my_slot;
+    args.members = members;
+    args.member_count = count;
     args.shm_id = shm_id;
 
     // We create a terminate_flag, which will be local to the calling process, and will be used 
     // to ensure synchronization between the two threads of the calling process. 
-    // The reader thread will raise this flag if it sees the message "TERMINATE"
-    // The writer thread will periodically check it in order to not be stuck in stdin and terminate as well.
+    // The reader thread will raise this flag once every dialog has been terminated (CONTROL_TERMINATE), and it will write to the
+    // wake_fd pipe, on which the writer thread polls next to stdin, so the writer terminates as well
+    // without having to wake up periodically.
 
     volatile sig_atomic_t terminate_flag = 0;
     args.terminate_flag = &terminate_flag;
+    if (pipe(args.wake_fd) != 0) {
+        perror("pipe");
+        exit(errno);
+    }
+
+    // SIGUSR1 prints the latency histograms of the reader. It is blocked here, before any thread exists,
+    // so every thread inherits the mask and only the signal thread takes it, with sigwait.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
 
     // Create threads and pass the arguments to them
-    pthread_t reader_tid, writer_tid;
+    pthread_t reader_tid, writer_tid, signal_tid;
 
     if (pthread_create(&reader_tid, NULL, reader_thread, &args) != 0) {
         perror("pthread_create reader");
@@ -87,35 +163,50 @@ int main(int argc, char *argv[]) {
         exit(errno);
     }
 
-    // Join the threads to the main, so that main wait until the I/O loop is finished (either with TERMINATE or EOF)
-    pthread_join(writer_tid, NULL);
-    pthread_join(reader_tid, NULL);
+    if (pthread_create(&signal_tid, NULL, signal_thread, &args) != 0) {
+        perror("pthread_create signal");
+        exit(errno);
+    }
 
-    // Before a process leaves the dialog, we need to enter a critical section again, in order to signify to the shared
-    // memory that a process is leaving. We release the slot of the dialog (the 1 of the 32 total), and we decrease the
-    // total_processes variable (inside leave_dialog). We check if the dialog is the last one remaining, in order to 
-    // ensure that the global cleanup only happens once all processes have terminated.
+    // The journal thread writes what the cleanup staged into the journal, and to disk every DIALOG_JOURNAL_SYNC_MS.
+    pthread_t journal_tid;
+    if (journaling && pthread_create(&journal_tid, NULL, journal_thread, &args) != 0) {
+        perror("pthread_create journal");
+        exit(errno);
+    }
 
-    sem_wait(mutex);
-    leave_dialog(shared_mem, dialog, my_slot);
-    int last = (shared_mem->total_processes == 0);
-    sem_post(mutex);
+    // Join the threads to the main, so that main wait until the I/O loop is finished (either with a terminate or EOF)
+    pthread_join(writer_tid, NULL);
+    pthread_join(reader_tid, NULL);
+    if (journaling) pthread_join(journal_tid, NULL);
+    pthread_kill(signal_tid, SIGUSR1);                           // the terminate flag is raised: it exits
+    pthread_join(signal_tid, NULL);
+    if (cfg.latency_at_exit) latency_dump(members, count);
+    close(args.wake_fd[0]);
+    close(args.wake_fd[1]);
+
+    // Before a process leaves a dialog, we need to enter the critical section of the dialog again, in order to
+    // signify that a process is leaving. We release the slot of every dialog under its dialog lock.
+
+    for (int i = 0; i < count; i++) {
+        lock_counted(&members[i].dialog->dialog_lock, &members[i].dialog->stats.lock);
+        leave_dialog(members[i].dialog, members[i].my_slot);
+        pthread_mutex_unlock(&members[i].dialog->dialog_lock);
+    }
 
-    // If indeed this is the last process, we do the global cleanup and return 0 to the main.
-    // What exactly happens during the global cleanup is mentioned in utils.h in the function's description.
+    // Then we decrease the total_processes variable under the global mutex. We check if this is the last process
+    // remaining, in order to ensure that the global cleanup only happens once all processes have terminated.
+    // The mutex stays held during the cleanup so that no new process can attach half-destroyed state.
 
-    if (last) {
-        sem_wait(mutex);
-        cleanup_if_last_process(shared_mem, shm_id);
-        return 0;
-    }
+    lock_counted(mutex, &shared_mem->mutex_stats);
+    for (int i = 0; i < count; i++) unregister_process(shared_mem);
 
-    // If there still are processes that are alive, we do only per-process clean up.
-    // Detach from the shared memory and close the mutex file descriptor only for this 
-    // process as there are still other processes using it.
+    // If indeed this is the last process, we do the global cleanup. What exactly happens during the global
+    // cleanup is mentioned in utils.h in the function's description. If there still are processes that
+    // are alive, we do only per-process clean up: we detach from the shared memory and close the mutex
+    // only for this process, as there are still other processes using them.
 
-    shmdt(shared_mem);
-    sem_close(mutex);
+    detach_shared_memory(shared_mem, shm_id);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,250 @@
+/* dialogstat.c
+    Live inspector of a running dialog system, in the spirit of vmstat. It attaches the shared
+    memory segment of DIALOG_SHM_KEY read-only, without registering as a process of it, samples
+    the statistics counters every interval and prints the rates of every dialog that is in use:
+    queue depth, sends and receives, full-dialog rejections, dropped messages, wakeup system calls (also per
+    delivered message), reader sleeps and the waits for the dialog lock and the global mutex, plus the
+    participants reaped after their process died and the locks taken over from a dead owner.
+
+    Usage: ./dialogstat [-s] [interval_seconds [count]]
+    -s also prints one line per occupied participant slot.
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "../include/utils.h"
+
+#define ERROR_BAD_OPTION 1
+#define ERROR_NO_SEGMENT 2
+#define HEADER_EVERY 20                                          // repeat the column titles every this many reports
+
+/*  One sample of the counters of a participant slot, plus who occupies it.
+*/
+typedef struct {
+    int mode;                                                    // SLOT_FREE, SLOT_READER or SLOT_SEND_ONLY
+    pid_t pid;
+    uint64_t sent, sent_bytes, full, timed_out, received, received_bytes, sleeps, skipped;
+} slot_sample_t;
+
+/*  One sample of the counters of a dialog.
+*/
+typedef struct {
+    int is_active;
+    int participants;
+    uint64_t depth;                                              // messages not yet read by every reader
+    uint64_t wakeups;
+    uint64_t dropped;
+    uint64_t reaped;
+    lock_stats_t lock;
+} dialog_sample_t;
+
+typedef struct {
+    uint64_t taken_ns;
+    int total_processes;
+    uint64_t mutex_acquired, mutex_contended, mutex_wait_ns, mutex_recovered;
+    dialog_sample_t *dialogs;                                    // max_dialogs entries
+    slot_sample_t *slots;                                        // max_participants entries per dialog
+} sample_t;
+
+static void take_sample(shared_memory_t *shared_mem, sample_t *s) {
+    s->taken_ns = monotonic_ns();
+    s->total_processes = shared_mem->total_processes;
+    s->mutex_acquired = atomic_load_explicit(&shared_mem->mutex_stats.acquired, memory_order_relaxed);
+    s->mutex_contended = atomic_load_explicit(&shared_mem->mutex_stats.contended, memory_order_relaxed);
+    s->mutex_wait_ns = atomic_load_explicit(&shared_mem->mutex_stats.wait_ns, memory_order_relaxed);
+    s->mutex_recovered = atomic_load_explicit(&shared_mem->mutex_stats.recovered, memory_order_relaxed);
+
+    uint32_t participants = shared_mem->max_participants;
+    for (uint32_t i = 0; i < shared_mem->max_dialogs; i++) {
+        dialog_sample_t *d = &s->dialogs[i];
+        if (!dialog_ready(shared_mem, (int)i)) {                 // never used: reading it would fault its pages in
+            memset(d, 0, sizeof(*d));
+            memset(&s->slots[i * participants], 0, participants * sizeof(slot_sample_t));
+            continue;
+        }
+        dialog_t *dialog = dialog_at(shared_mem, (int)i);
+
+        d->is_active = dialog->is_active;
+        d->participants = dialog->dialog_participants;
+        uint64_t tail = atomic_load_explicit(&dialog->tail_seq, memory_order_acquire);
+        uint64_t write = atomic_load_explicit(&dialog->write_seq, memory_order_acquire);
+        d->depth = write > tail ? write - tail : 0;
+        d->wakeups = atomic_load_explicit(&dialog->stats.wakeups, memory_order_relaxed);
+        d->dropped = atomic_load_explicit(&dialog->stats.dropped, memory_order_relaxed);
+        d->reaped = atomic_load_explicit(&dialog->stats.reaped, memory_order_relaxed);
+        d->lock.acquired = atomic_load_explicit(&dialog->stats.lock.acquired, memory_order_relaxed);
+        d->lock.contended = atomic_load_explicit(&dialog->stats.lock.contended, memory_order_relaxed);
+        d->lock.wait_ns = atomic_load_explicit(&dialog->stats.lock.wait_ns, memory_order_relaxed);
+        d->lock.recovered = atomic_load_explicit(&dialog->stats.lock.recovered, memory_order_relaxed);
+
+        for (uint32_t j = 0; j < participants; j++) {
+            slot_stats_t *st = &dialog_slot_stats(dialog)[j];
+            slot_sample_t *out = &s->slots[i * participants + j];
+
+            int used = slot_in(dialog->slot_mask, (int)j), reads = slot_in(dialog->reader_mask, (int)j);
+            out->mode = !used ? SLOT_FREE : reads ? SLOT_READER : SLOT_SEND_ONLY;
+            out->pid = dialog_cursors(dialog)[j].pid;
+            out->sent = atomic_load_explicit(&st->sent, memory_order_relaxed);
+            out->sent_bytes = atomic_load_explicit(&st->sent_bytes, memory_order_relaxed);
+            out->full = atomic_load_explicit(&st->full, memory_order_relaxed);
+            out->timed_out = atomic_load_explicit(&st->timed_out, memory_order_relaxed);
+            out->received = atomic_load_explicit(&st->received, memory_order_relaxed);
+            out->received_bytes = atomic_load_explicit(&st->received_bytes, memory_order_relaxed);
+            out->sleeps = atomic_load_explicit(&st->sleeps, memory_order_relaxed);
+            out->skipped = atomic_load_explicit(&st->skipped, memory_order_relaxed);
+        }
+    }
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+    return now >= before ? (double)(now - before) / seconds : 0.0; // a reset segment makes counters go back
+}
+
+static void print_header(void) {
+    printf("%4s %4s %13s %9s %9s %7s %7s %7s %7s %6s %7s %6s %8s\n",
+           "dlg", "part", "depth/ring", "send/s", "recv/s", "MB/s", "full/s", "drop/s", "wake/s", "wk/msg",
+           "sleep/s", "lock/s", "lkwait_us");
+}
+
+static void print_report(shared_memory_t *shared_mem, const sample_t *prev, const sample_t *cur, int per_slot, int with_header) {
+    double seconds = (double)(cur->taken_ns - prev->taken_ns) / 1e9;
+    uint32_t participants = shared_mem->max_participants;
+
+    // Crash recovery is rare, so it is reported as totals since the segment was created.
+    uint64_t reaped = 0, recovered = cur->mutex_recovered;
+    for (uint32_t i = 0; i < shared_mem->max_dialogs; i++) {
+        reaped += cur->dialogs[i].reaped;
+        recovered += cur->dialogs[i].lock.recovered;
+    }
+
+    printf("-- %d processes, global mutex: %.1f acq/s, %.1f contended/s, %.1f us waited/s; "
+           "%" PRIu64 " dead participants reaped, %" PRIu64 " locks recovered\n",
+           cur->total_processes,
+           rate(cur->mutex_acquired, prev->mutex_acquired, seconds),
+           rate(cur->mutex_contended, prev->mutex_contended, seconds),
+           rate(cur->mutex_wait_ns, prev->mutex_wait_ns, seconds) / 1e3, reaped, recovered);
+    if (with_header) print_header();
+
+    for (uint32_t i = 0; i < shared_mem->max_dialogs; i++) {
+        const dialog_sample_t *d = &cur->dialogs[i], *pd = &prev->dialogs[i];
+
+        double sent = 0, received = 0, bytes = 0, full = 0, sleeps = 0;
+        double dropped = rate(d->dropped, pd->dropped, seconds); // reclaimed unread, plus given up by senders
+        for (uint32_t j = 0; j < participants; j++) {
+            const slot_sample_t *s = &cur->slots[i * participants + j], *ps = &prev->slots[i * participants + j];
+            sent += rate(s->sent, ps->sent, seconds);
+            received += rate(s->received, ps->received, seconds);
+            bytes += rate(s->sent_bytes, ps->sent_bytes, seconds);
+            full += rate(s->full, ps->full, seconds);
+            dropped += rate(s->timed_out, ps->timed_out, seconds);
+            sleeps += rate(s->sleeps, ps->sleeps, seconds);
+        }
+        double wakeups = rate(d->wakeups, pd->wakeups, seconds);
+        double locks = rate(d->lock.acquired, pd->lock.acquired, seconds);
+        if (!d->is_active && sent == 0 && received == 0 && locks == 0) continue; // idle and unused: skip it
+
+        char depth[32];
+        snprintf(depth, sizeof(depth), "%" PRIu64 "/%u", d->depth, shared_mem->ring_size);
+        printf("%4u %4d %13s %9.0f %9.0f %7.2f %7.0f %7.0f %7.0f %6.3f %7.0f %6.0f %8.1f\n",
+               i, d->participants, depth, sent, received, bytes / 1e6, full, dropped, wakeups,
+               received > 0 ? wakeups / received : 0.0, sleeps, locks,
+               rate(d->lock.wait_ns, pd->lock.wait_ns, seconds) / 1e3);
+
+        if (!per_slot) continue;
+        for (uint32_t j = 0; j < participants; j++) {
+            const slot_sample_t *s = &cur->slots[i * participants + j], *ps = &prev->slots[i * participants + j];
+            if (s->mode == SLOT_FREE) continue;
+            printf("     slot %2u pid %-7d %-9s send/s %9.0f recv/s %9.0f full/s %7.0f sleep/s %7.0f skip/s %7.0f\n",
+                   j, (int)s->pid, s->mode == SLOT_READER ? "reader" : "send-only",
+                   rate(s->sent, ps->sent, seconds), rate(s->received, ps->received, seconds),
+                   rate(s->full, ps->full, seconds), rate(s->sleeps, ps->sleeps, seconds),
+                   rate(s->skipped, ps->skipped, seconds));
+        }
+    }
+    fflush(stdout);
+}
+
+static long parse_number(const char *s, const char *what) {
+    char *end = NULL;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < 1) {
+        fprintf(stderr, "Error: %s must be a positive integer\n", what);
+        exit(ERROR_BAD_OPTION);
+    }
+    return v;
+}
+
+int main(int argc, char *argv[]) {
+    int per_slot = 0;
+    long interval = 1, count = -1;                               // by default report every second, forever
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') per_slot = 1;
+        else {
+            fprintf(stderr, "Usage: %s [-s] [interval_seconds [count]]\n", argv[0]);
+            exit(ERROR_BAD_OPTION);
+        }
+    }
+    if (optind < argc) interval = parse_number(argv[optind++], "interval");
+    if (optind < argc) count = parse_number(argv[optind++], "count");
+
+    dialog_config_t cfg;
+    load_config(&cfg);
+
+    // Never create the segment: we only watch an existing one, and read-only, so a bug here
+    // can not disturb the processes that use it.
+    int shm_id = shmget(cfg.shm_key, 0, 0);
+    if (shm_id == -1) {
+        fprintf(stderr, "No dialog segment for key %d\n", (int)cfg.shm_key);
+        exit(ERROR_NO_SEGMENT);
+    }
+    shared_memory_t *shared_mem = shmat(shm_id, NULL, SHM_RDONLY);
+    if (shared_mem == (void*)-1) {
+        perror("shmat");
+        exit(errno);
+    }
+    if (!shared_mem->is_initialized || shared_mem->magic != DIALOG_SHM_MAGIC ||
+        shared_mem->version != DIALOG_SHM_VERSION) {
+        fprintf(stderr, "The segment for key %d is not initialized or has an incompatible layout\n", (int)cfg.shm_key);
+        exit(ERROR_NO_SEGMENT);
+    }
+
+    size_t slots = (size_t)shared_mem->max_dialogs * shared_mem->max_participants;
+    sample_t samples[2];
+    for (int k = 0; k < 2; k++) {
+        samples[k].dialogs = calloc(shared_mem->max_dialogs, sizeof(dialog_sample_t));
+        samples[k].slots = calloc(slots, sizeof(slot_sample_t));
+        if (!samples[k].dialogs || !samples[k].slots) {
+            perror("calloc");
+            exit(errno);
+        }
+    }
+
+    int cur = 0;
+    take_sample(shared_mem, &samples[cur]);
+
+    for (long reports = 0; count < 0 || reports < count; reports++) {
+        sleep((unsigned)interval);
+
+        struct shmid_ds info;
+        if (shmctl(shm_id, IPC_STAT, &info) != 0 || (info.shm_perm.mode & SHM_DEST)) {
+            printf("-- segment removed, the last process has left\n");
+            break;
+        }
+
+        cur ^= 1;
+        take_sample(shared_mem, &samples[cur]);
+        print_report(shared_mem, &samples[cur ^ 1], &samples[cur], per_slot, reports % HEADER_EVERY == 0);
+    }
+
+    for (int k = 0; k < 2; k++) {
+        free(samples[k].dialogs);
+        free(samples[k].slots);
+    }
+    shmdt(shared_mem);
+    return 0;
+}
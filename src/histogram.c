@@ -0,0 +1,71 @@
+/* histogram.c */
+
+#include "../include/histogram.h"
+#include "../include/stats.h"
+
+/*  Values below HIST_SUB_BUCKETS have a bucket each. Above, the bucket is given by the position of
+    the highest set bit (the power of two) and the HIST_SUB_BITS bits below it (the sub-bucket).
+*/
+static int bucket_of(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXPONENT) return HIST_BUCKETS - 1;
+    int sub = (int)(value >> (exponent - HIST_SUB_BITS)) - HIST_SUB_BUCKETS;
+    return HIST_SUB_BUCKETS + (exponent - HIST_SUB_BITS) * HIST_SUB_BUCKETS + sub;
+}
+
+/*  The highest value that falls into the given bucket.
+*/
+static uint64_t bucket_high(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) return (uint64_t)bucket;
+    int exponent = (bucket - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + HIST_SUB_BITS;
+    uint64_t sub = (uint64_t)((bucket - HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS);
+    uint64_t width = 1ull << (exponent - HIST_SUB_BITS);
+    return (HIST_SUB_BUCKETS + sub + 1) * width - 1;
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+    stat_add(&h->counts[bucket_of(value)], 1);
+    stat_add(&h->total, 1);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+void hist_merge(histogram_t *into, const histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        stat_add(&into->counts[i], atomic_load_explicit(&from->counts[i], memory_order_relaxed));
+    }
+    stat_add(&into->total, atomic_load_explicit(&from->total, memory_order_relaxed));
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&into->max, memory_order_relaxed)) {
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+    }
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p) {
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * (double)total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen > rank) {
+            uint64_t high = bucket_high(i);
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return high < max ? high : max;                      // never above the largest value seen
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed); // counts still being recorded by the other thread
+}
+
+void hist_print(FILE *out, const char *label, const histogram_t *h) {
+    fprintf(out, "%-28s n %-10llu p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  p99.99 %9.1f  max %9.1f us\n",
+            label, (unsigned long long)atomic_load_explicit(&h->total, memory_order_relaxed),
+            (double)hist_percentile(h, 0.50) / 1e3, (double)hist_percentile(h, 0.90) / 1e3,
+            (double)hist_percentile(h, 0.99) / 1e3, (double)hist_percentile(h, 0.999) / 1e3,
+            (double)hist_percentile(h, 0.9999) / 1e3,
+            (double)atomic_load_explicit(&h->max, memory_order_relaxed) / 1e3);
+}
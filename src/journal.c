@@ -0,0 +1,402 @@
+/* journal.c */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "../include/journal.h"
+#include "../include/notify.h"
+
+/*  The mapping of a journal in this process. Mappings are process-local, so they are kept here and
+    never in shared memory. A process may use dialogs of more than one segment, so a mapping belongs
+    to the key of the segment and the id of the dialog: the entries form an open-addressing table,
+    and an entry keeps its key and id once used is set, so lookups need no lock.
+*/
+typedef struct {
+    _Atomic int used;
+    key_t shm_key;
+    int dialog_id;
+    _Atomic int mapped;
+    journal_header_t *header;
+    char *data;
+    size_t map_size;
+} journal_map_t;
+
+#define JOURNAL_MAPS (2 * MAX_DIALOGS_LIMIT)                     // twice the dialogs of one segment
+
+static journal_map_t journals[JOURNAL_MAPS];
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;   // serializes the mapping of journals in this process
+
+/*  Returns the entry of the dialog in journals, or NULL if it has none. With claim set (and map_lock
+    held) a free entry is taken for it instead; NULL then means that the table is full.
+*/
+static journal_map_t *find_map(dialog_t *dialog, int claim) {
+    key_t key = dialog_segment(dialog)->shm_key;
+    uint32_t at = ((uint32_t)key * 2654435761u + (uint32_t)dialog->dialog_id) % JOURNAL_MAPS;
+    for (uint32_t i = 0; i < JOURNAL_MAPS; i++, at = (at + 1) % JOURNAL_MAPS) {
+        journal_map_t *j = &journals[at];
+        if (!atomic_load_explicit(&j->used, memory_order_acquire)) {
+            if (!claim) return NULL;                             // entries are never given back, so it is not further on
+            j->shm_key = key;
+            j->dialog_id = dialog->dialog_id;
+            atomic_store_explicit(&j->used, 1, memory_order_release);
+            return j;
+        }
+        if (j->shm_key == key && j->dialog_id == dialog->dialog_id) return j;
+    }
+    return NULL;
+}
+
+static uint64_t record_size(uint32_t length) {
+    return sizeof(journal_record_t) + (((uint64_t)length + 7) & ~(uint64_t)7);
+}
+
+/*  Opens and maps the journal file at path. When create is set the file is created and sized for
+    size bytes of records if needed, and its header is initialized if it is new.
+*/
+static int map_file(journal_map_t *j, const char *path, int create, uint64_t size) {
+    int fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < JOURNAL_DATA_OFFSET) {                      // new file: give it its full size
+        if (!create || ftruncate(fd, (off_t)(JOURNAL_DATA_OFFSET + size)) != 0) {
+            fprintf(stderr, "Journal %s is not usable\n", path);
+            close(fd);
+            return -1;
+        }
+        st.st_size = (off_t)(JOURNAL_DATA_OFFSET + size);
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                                                   // the mapping keeps the file open
+    if (p == MAP_FAILED) {
+        perror("mmap journal");
+        return -1;
+    }
+
+    journal_header_t *header = p;
+    if (header->magic == 0 && create) {                          // fresh file, we hold the dialog_lock
+        header->version = JOURNAL_VERSION;
+        header->capacity = (uint64_t)st.st_size - JOURNAL_DATA_OFFSET;
+        atomic_store(&header->end, 0);
+        atomic_store(&header->synced, 0);
+        atomic_store(&header->next_seq, 0);
+        atomic_store(&header->full, 0);
+        atomic_store_explicit((_Atomic uint32_t*)&header->magic, JOURNAL_MAGIC, memory_order_release);
+    }
+    if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+        header->capacity > (uint64_t)st.st_size - JOURNAL_DATA_OFFSET) {
+        fprintf(stderr, "Journal %s has an incompatible format\n", path);
+        munmap(p, (size_t)st.st_size);
+        return -1;
+    }
+
+    j->header = header;
+    j->data = (char*)p + JOURNAL_DATA_OFFSET;
+    j->map_size = (size_t)st.st_size;
+    return 0;
+}
+
+static void unmap_journal(journal_map_t *j) {
+    pthread_mutex_lock(&map_lock);
+    if (atomic_load(&j->mapped)) {
+        atomic_store(&j->mapped, 0);
+        munmap(j->header, j->map_size);
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+int journal_create(dialog_t *dialog, key_t shm_key, const char *dir, uint64_t size, uint32_t sync_ms) {
+    int n = snprintf(dialog->journal_path, sizeof(dialog->journal_path), "%s/dialog-%d-%d.journal",
+                     dir, (int)shm_key, dialog->dialog_id);
+    if (n < 0 || (size_t)n >= sizeof(dialog->journal_path)) {
+        fprintf(stderr, "Journal directory name is too long\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&map_lock);
+    journal_map_t *j = find_map(dialog, 1);
+    pthread_mutex_unlock(&map_lock);
+    if (j == NULL) {
+        fprintf(stderr, "Too many journals in this process\n");
+        return -1;
+    }
+    unmap_journal(j);                                            // a mapping of an earlier activation
+    pthread_mutex_lock(&map_lock);
+    int rc = map_file(j, dialog->journal_path, 1, size);
+    if (rc == 0) atomic_store(&j->mapped, 1);
+    pthread_mutex_unlock(&map_lock);
+    if (rc != 0) return -1;
+
+    // Continue the numbering of the journal if this dialog has not been used in this segment yet,
+    // so a replay never sees the same sequence number twice.
+    uint64_t next = atomic_load(&j->header->next_seq);
+    if (atomic_load(&dialog->write_seq) == 0 && next > 0) {
+        atomic_store(&dialog->write_seq, next);
+        atomic_store(&dialog->tail_seq, next);
+    }
+    if (dialog->staged_seq < next) dialog->staged_seq = next;   // the staging area was emptied when the dialog closed
+
+    dialog->journal_sync_ms = sync_ms;
+    dialog->journal_enabled = 1;
+    return 0;
+}
+
+/*  Returns the mapping of the journal of the dialog in this process, mapping it first if needed,
+    or NULL if the dialog keeps no journal or it can not be mapped.
+*/
+static journal_map_t *open_map(dialog_t *dialog) {
+    if (!dialog->journal_enabled) return NULL;
+    journal_map_t *j = find_map(dialog, 0);
+    if (j && atomic_load_explicit(&j->mapped, memory_order_acquire)) return j;
+
+    pthread_mutex_lock(&map_lock);
+    j = find_map(dialog, 1);
+    if (j && !atomic_load(&j->mapped)) {
+        if (map_file(j, dialog->journal_path, 0, 0) == 0) atomic_store_explicit(&j->mapped, 1, memory_order_release);
+        else j = NULL;
+    }
+    pthread_mutex_unlock(&map_lock);
+    return j;
+}
+
+int journal_open(dialog_t *dialog) {
+    return open_map(dialog) ? 0 : -1;
+}
+
+/*  Copies len bytes from buf into the staging area of the dialog at byte pos of its records, which
+    wrap around the end of the area, and back out of it.
+*/
+static void staging_put(dialog_t *dialog, uint64_t pos, const void *buf, uint32_t len) {
+    uint32_t at = (uint32_t)(pos % dialog->staging_size);
+    uint32_t first = dialog->staging_size - at < len ? dialog->staging_size - at : len;
+    memcpy(dialog_staging(dialog) + at, buf, first);
+    memcpy(dialog_staging(dialog), (const char*)buf + first, len - first);
+}
+
+static void staging_get(dialog_t *dialog, uint64_t pos, void *buf, uint64_t len) {
+    uint32_t at = (uint32_t)(pos % dialog->staging_size);
+    uint64_t first = dialog->staging_size - at < len ? dialog->staging_size - at : len;
+    memcpy(buf, dialog_staging(dialog) + at, first);
+    memcpy((char*)buf + first, dialog_staging(dialog), len - first);
+}
+
+int journal_append(dialog_t *dialog, const message_t *m, uint64_t seq) {
+    if (seq < dialog->staged_seq) return 0;                      // staged already
+    if (m->payload_len == 0) return 0;                           // abandoned by a sender that died
+    if (m->stream_id != 0) return 0;                             // fragments of a stream are not journaled
+
+    uint64_t need = record_size(m->payload_len);
+    uint64_t tail = atomic_load_explicit(&dialog->stage_tail, memory_order_relaxed); // we are the only producer
+    uint64_t head = atomic_load_explicit(&dialog->stage_head, memory_order_acquire);
+    if (tail + need - head > dialog->staging_size) {
+        journal_drain(dialog, 0);                                // no journal thread keeps up: write it out ourselves
+        head = atomic_load_explicit(&dialog->stage_head, memory_order_acquire);
+        if (tail + need - head > dialog->staging_size) return -1; // another process is writing it out
+    }
+
+    journal_record_t rec = { seq, m->payload_len, m->sender_slot, 0, (int32_t)m->sender_pid,
+                             m->recipient_words == 0 ? JOURNAL_TO_ALL : 0 };
+    staging_put(dialog, tail, &rec, sizeof(rec));
+    staging_put(dialog, tail + sizeof(rec), dialog_payloads(dialog) + m->payload_off, m->payload_len);
+    atomic_store_explicit(&dialog->stage_tail, tail + need, memory_order_release); // the drainer may now take it
+    dialog->staged_seq = seq + 1;
+
+    uint32_t half = dialog->staging_size / 2;
+    if (tail - head <= half && tail + need - head > half) dialog_notify_journal(dialog);
+    return 0;
+}
+
+void journal_drain(dialog_t *dialog, int wait) {
+    journal_map_t *j = open_map(dialog);
+    if (j == NULL) return;
+
+    // One drainer at a time, so the records reach the file in order. The flag of a dead process is
+    // taken over, as the global mutex and the initialization of a dialog are.
+    pid_t me = getpid(), owner = 0;
+    while (!atomic_compare_exchange_weak(&dialog->draining, &owner, me)) {
+        if (owner > 0 && process_dead(owner)) atomic_compare_exchange_strong(&dialog->draining, &owner, 0);
+        else if (!wait) return;
+        else sched_yield();
+        owner = 0;
+    }
+
+    journal_header_t *header = j->header;
+    uint64_t head = atomic_load_explicit(&dialog->stage_head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&dialog->stage_tail, memory_order_acquire);
+    uint64_t freed = head;
+    while (head < tail) {
+        journal_record_t rec;
+        staging_get(dialog, head, &rec, sizeof(rec));
+        uint64_t need = record_size(rec.length);
+
+        // A drainer that died after writing the record, but before moving the head past it, left it
+        // here; next_seq tells.
+        uint64_t end = atomic_load_explicit(&header->end, memory_order_relaxed);
+        if (rec.seq >= atomic_load_explicit(&header->next_seq, memory_order_relaxed) && !atomic_load(&header->full)) {
+            if (end + need > header->capacity) {
+                atomic_store(&header->full, 1);
+                fprintf(stderr, "Journal %s is full, later messages are not journaled\n", dialog->journal_path);
+            }
+            else {
+                staging_get(dialog, head, j->data + end, need);
+                atomic_store_explicit(&header->end, end + need, memory_order_release); // readers may now see the record
+                atomic_store_explicit(&header->next_seq, rec.seq + 1, memory_order_relaxed);
+            }
+        }
+        head += need;
+        atomic_store_explicit(&dialog->stage_head, head, memory_order_release);
+    }
+    atomic_store_explicit(&dialog->draining, 0, memory_order_release);
+
+    if (head > freed) dialog_notify_space(dialog);               // a cleanup that found the area full may go on now
+}
+
+uint64_t journal_seek(dialog_t *dialog, uint64_t seq) {
+    journal_map_t *j = open_map(dialog);
+    if (j == NULL) return 0;
+    journal_drain(dialog, 1);                                    // what has left the ring may still be staged
+    uint64_t end = atomic_load_explicit(&j->header->end, memory_order_acquire);
+
+    uint64_t pos = 0;
+    while (pos < end) {                                          // records are in sequence order
+        journal_record_t rec;
+        memcpy(&rec, j->data + pos, sizeof(rec));
+        if (rec.seq >= seq) break;
+        pos += record_size(rec.length);
+    }
+    return pos;
+}
+
+int journal_read(dialog_t *dialog, uint64_t *pos, uint64_t to_seq, received_message_t *out) {
+    journal_map_t *j = open_map(dialog);
+    if (j == NULL) return 0;
+    uint64_t end = atomic_load_explicit(&j->header->end, memory_order_acquire);
+
+    while (*pos < end) {
+        journal_record_t rec;
+        uint64_t at = *pos;
+        memcpy(&rec, j->data + at, sizeof(rec));
+        if (rec.seq >= to_seq || rec.length > MAX_MSG_SIZE) return 0;
+        *pos += record_size(rec.length);
+        if (rec.recipients != JOURNAL_TO_ALL) continue;          // directed: not for a newcomer
+
+        out->seq = rec.seq;
+        out->dialog_id = dialog->dialog_id;
+        out->sender_slot = rec.sender_slot;
+        out->sender_pid = rec.sender_pid;
+        out->length = rec.length;
+        out->stream_id = 0;
+        out->stream_offset = 0;
+        out->stream_length = 0;
+        memcpy(out->text, j->data + at + sizeof(rec), rec.length);
+        out->text[rec.length] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+void journal_sync(dialog_t *dialog) {
+    journal_map_t *j = open_map(dialog);
+    if (j == NULL) return;
+    journal_drain(dialog, 1);
+    journal_header_t *header = j->header;
+
+    uint64_t end = atomic_load_explicit(&header->end, memory_order_acquire);
+    uint64_t synced = atomic_load(&header->synced);
+    if (synced >= end) return;                                   // nothing new since the last sync
+
+    // msync needs a page-aligned start; the header page is synced along with the first records.
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t from = (JOURNAL_DATA_OFFSET + synced) & ~(page - 1);
+    if (msync((char*)header + from, JOURNAL_DATA_OFFSET + end - from, MS_SYNC) != 0) {
+        perror("msync journal");
+        return;
+    }
+    while (synced < end && !atomic_compare_exchange_weak(&header->synced, &synced, end)) { }
+}
+
+void journal_close_dialog(dialog_t *dialog, int my_slot) {
+    if (!dialog->journal_enabled) return;
+
+    // An owner whose slot is gone died after leaving it, in here. The reaper would take its flag
+    // over, but only under the dialog_lock we hold, so we do it ourselves, by the same rule.
+    int idle = 0;
+    while (!atomic_compare_exchange_weak_explicit(&dialog->reclaiming, &idle, my_slot + 1,
+                                                  memory_order_acquire, memory_order_relaxed)) { // become the only writer
+        if (idle > 0 && !slot_in(dialog->slot_mask, idle - 1)) {
+            atomic_compare_exchange_strong(&dialog->reclaiming, &idle, 0);
+        }
+        idle = 0;
+        sched_yield();
+    }
+    uint64_t write = atomic_load(&dialog->write_seq);
+    for (uint64_t seq = atomic_load(&dialog->tail_seq); seq < write; seq++) {
+        message_t *m = &dialog_messages(dialog)[seq & dialog->ring_mask];
+        if (atomic_load_explicit(&m->seq, memory_order_acquire) != MSG_CELL_SEQ(seq)) break;
+        while (journal_append(dialog, m, seq) != 0) journal_drain(dialog, 1); // they stay in the ring as well
+    }
+    atomic_store_explicit(&dialog->reclaiming, 0, memory_order_release);
+
+    journal_sync(dialog);
+    journal_map_t *j = find_map(dialog, 0);
+    if (j) unmap_journal(j);
+    dialog->journal_enabled = 0;                                 // the next activation decides again
+}
+
+void* journal_thread(void *arg) {
+    thread_args_t *input = (thread_args_t*)arg;
+    uint32_t ms = DEFAULT_JOURNAL_SYNC_MS;
+    dialog_t *first = NULL;                                      // the one whose futex we sleep on
+    int journaled = 0;
+    for (int i = 0; i < input->member_count; i++) {              // the shortest period of our journaled dialogs
+        dialog_t *dialog = input->members[i].dialog;
+        if (!dialog->journal_enabled) continue;
+        if (dialog->journal_sync_ms < ms) ms = dialog->journal_sync_ms;
+        if (first == NULL) first = dialog;
+        journaled++;
+    }
+    uint64_t next_sync = monotonic_ns() + (uint64_t)ms * 1000000u;
+
+    // We sleep until the staging area of the first journaled dialog is half full or the period is over,
+    // and write out what was staged in every one of them. With several dialogs the others are looked at
+    // every WAIT_ANY_SLICE_MS as well. Once per period the journals are synced to disk too.
+    while (1) {
+        int last = *input->terminate_flag;
+        uint64_t now = monotonic_ns();
+        if (!last && first && now < next_sync) {
+            uint32_t seen = atomic_load(&first->journal_word);
+            uint64_t staged = atomic_load(&first->stage_tail) - atomic_load(&first->stage_head);
+            int wait_ms = (int)((next_sync - now + 999999) / 1000000);
+            if (journaled > 1 && wait_ms > WAIT_ANY_SLICE_MS) wait_ms = WAIT_ANY_SLICE_MS;
+            if (staged <= first->staging_size / 2) dialog_wait_journal(first, seen, wait_ms);
+        }
+        else if (!last && first == NULL) {                       // nothing to wait for but the next sync
+            struct timespec period = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+            nanosleep(&period, NULL);
+        }
+
+        int sync = last || monotonic_ns() >= next_sync;
+        for (int i = 0; i < input->member_count; i++) {
+            dialog_t *dialog = input->members[i].dialog;
+            if (!dialog->journal_enabled) continue;
+            if (sync) journal_sync(dialog);                      // one msync for everything written out meanwhile
+            else journal_drain(dialog, 0);
+        }
+        if (sync) next_sync = monotonic_ns() + (uint64_t)ms * 1000000u;
+        if (last) break;
+    }
+    return NULL;
+}
@@ -0,0 +1,395 @@
+/* libdialog.c */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "../include/dialog.h"
+#include "../include/libdialog.h"
+
+#define ERROR_MSG_SIZE 6                                         // as returned by message_send_stream
+
+_Static_assert(sizeof(dialog_recipients_t) == sizeof(slot_set_t) && DIALOG_MAX_PARTICIPANTS == MAX_DIALOG_PARTICIPANTS,
+               "dialog_recipients_t is the slot_set_t of the library interface");
+_Static_assert(DIALOG_CONTROL_TERMINATE == CONTROL_TERMINATE && DIALOG_CONTROL_FLUSH == CONTROL_FLUSH &&
+               DIALOG_CONTROL_PAUSE == CONTROL_PAUSE && DIALOG_CONTROL_RESUME == CONTROL_RESUME &&
+               DIALOG_CONTROL_JOIN == CONTROL_JOIN && DIALOG_CONTROL_LEAVE == CONTROL_LEAVE,
+               "the library hands out the control events as they are");
+
+/*  The state of a program that uses the library.
+    shared_mem / shm_id / cfg: the attached segment (NULL if attaching it failed) and the configuration
+    it was attached with
+    members / count: the joined dialogs. Each one reads with message_peek from its view_seq.
+    next: the member dialog_receive looks at first, so that a busy dialog does not starve the others
+    spin_budget: the spin budget of dialog_wait_any, adapted like the one of the reader thread
+    last_stream: the number of the last stream sent by this process (dialog_send_stream)
+*/
+struct dialog_handle {
+    shared_memory_t *shared_mem;
+    int shm_id;
+    dialog_config_t cfg;
+    membership_t members[MAX_JOINED_DIALOGS];
+    int count;
+    int next;
+    int spin_budget;
+    uint32_t last_stream;
+};
+
+static _Atomic int opened = 0;                                   // the global mutex pointer allows one segment per process
+
+/*  Attaches (and initializes if needed) the segment. It returns 0 with the global mutex held, or -1
+    with errno set, the segment detached and handle->shared_mem NULL: a library does not end the program.
+*/
+static int attach(dialog_handle_t *handle) {
+    shared_memory_t *shared_mem = NULL;
+    int rc = try_attach_and_lock_shared_mem(&handle->cfg, &shared_mem, &handle->shm_id);
+    if (rc == 0 && !shared_mem->is_initialized) rc = try_init_shared_memory(shared_mem, &handle->cfg, handle->shm_id);
+    if (rc == 0) rc = try_check_layout(shared_mem, handle->shm_id, 0);
+    handle->shared_mem = rc == 0 ? shared_mem : NULL;
+    return rc == 0 ? 0 : -1;
+}
+
+static int find_member(dialog_handle_t *handle, int dialog_id) {
+    for (int i = 0; i < handle->count; i++) {
+        if (handle->members[i].dialog_id == dialog_id) return i;
+    }
+    return -1;
+}
+
+dialog_handle_t* dialog_open(void) {
+    int closed = 0;
+    if (!atomic_compare_exchange_strong(&opened, &closed, 1)) {
+        errno = EBUSY;
+        return NULL;
+    }
+    dialog_handle_t *handle = calloc(1, sizeof(*handle));
+    if (handle == NULL) {
+        atomic_store(&opened, 0);
+        return NULL;
+    }
+
+    if (try_load_config(&handle->cfg) != 0 || attach(handle) != 0) {
+        int rc = errno;
+        free(handle);
+        atomic_store(&opened, 0);
+        errno = rc;
+        return NULL;
+    }
+    pthread_mutex_unlock(mutex);
+    handle->spin_budget = 64;
+    return handle;
+}
+
+int dialog_join(dialog_handle_t *handle, int dialog_id) {
+    if (dialog_id < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (find_member(handle, dialog_id) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (handle->count == MAX_JOINED_DIALOGS) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    // Until the first join this process is not registered, so the last process of the segment may
+    // have removed it in the meantime. Then we move on to the new segment, as ./dialog would, and if
+    // attaching that one failed we try again on the next join.
+    if (handle->shared_mem != NULL) {
+        lock_counted(mutex, &handle->shared_mem->mutex_stats);
+        if (handle->shared_mem->removed) {
+            pthread_mutex_unlock(mutex);
+            shmdt(handle->shared_mem);
+            handle->shared_mem = NULL;
+        }
+    }
+    if (handle->shared_mem == NULL && attach(handle) != 0) return -1;
+    if (dialog_id >= (int)handle->shared_mem->max_dialogs) {
+        pthread_mutex_unlock(mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    handle->shared_mem->total_processes++;                      // once per dialog, like ./dialog
+    pthread_mutex_unlock(mutex);
+
+    dialog_t *dialog = prepare_dialog(handle->shared_mem, dialog_id);
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    activate_dialog(dialog, dialog_id, &handle->cfg);
+    int my_slot = join_dialog(dialog, getpid(), SLOT_READER);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+
+    if (my_slot < 0) {
+        lock_counted(mutex, &handle->shared_mem->mutex_stats);
+        unregister_process(handle->shared_mem);
+        pthread_mutex_unlock(mutex);
+        errno = ENOSPC;
+        return -1;
+    }
+    journal_open(dialog);                                        // keep the mapping off the send path, if it has a journal
+
+    membership_t *m = &handle->members[handle->count++];
+    m->dialog = dialog;
+    m->dialog_id = dialog_id;
+    m->my_slot = my_slot;
+    m->active = 1;
+    m->zero_copy = 1;
+    m->view_seq = atomic_load(&dialog_cursors(dialog)[my_slot].read_seq);
+    m->latency = NULL;
+    return my_slot;
+}
+
+int dialog_send(dialog_handle_t *handle, int dialog_id, const void *data, size_t length,
+                const dialog_recipients_t *recipients) {
+    int i = find_member(handle, dialog_id);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    membership_t *m = &handle->members[i];
+    if (length == 0 || length > m->dialog->max_msg_size) {      // never truncate silently
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    const char *text = data;
+    uint32_t len = (uint32_t)length;
+    const slot_set_t *to = (const slot_set_t*)(const void*)recipients;
+    int sent = message_send_batch(m->dialog, m->my_slot, &text, &len, &to, 1);
+    if (sent <= 0) {
+        errno = sent < 0 ? EMSGSIZE : EAGAIN;
+        return -1;
+    }
+    dialog_notify(m->dialog);
+    return 0;
+}
+
+int dialog_send_stream(dialog_handle_t *handle, int dialog_id, const void *data, size_t length,
+                       const dialog_recipients_t *recipients) {
+    int i = find_member(handle, dialog_id);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (length == 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    membership_t *m = &handle->members[i];
+
+    if (++handle->last_stream == 0) handle->last_stream = 1;    // 0 marks ordinary messages
+    slot_set_t to;                                               // our own unread fragments would hold the window forever
+    if (recipients) memcpy(to.words, recipients->words, sizeof(to.words));
+    else memset(to.words, 0xff, sizeof(to.words));
+    to.words[m->my_slot / 64] &= ~((uint64_t)1 << (m->my_slot % 64));
+    int rc = message_send_stream(m->dialog, m->my_slot, handle->last_stream, data, length, &to,
+                                 handle->cfg.stream_window);
+    if (rc != 0) {
+        errno = rc == ERROR_MSG_SIZE ? EMSGSIZE : ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+int dialog_control(dialog_handle_t *handle, int dialog_id, int kind) {
+    int i = find_member(handle, dialog_id);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (kind < DIALOG_CONTROL_TERMINATE || kind > DIALOG_CONTROL_RESUME) { // joins and leaves are posted by the dialog
+        errno = EINVAL;
+        return -1;
+    }
+    message_control(handle->members[i].dialog, handle->members[i].my_slot, (uint32_t)kind);
+    return 0;
+}
+
+/*  Fills view with the control event e of member m.
+*/
+static void control_view(dialog_view_t *view, const membership_t *m, const control_event_t *e) {
+    memset(view, 0, sizeof(*view));
+    view->dialog_id = m->dialog_id;
+    view->sender_slot = e->slot;
+    view->sender_pid = e->pid;
+    view->seq = e->data_seq;
+    view->control = (int)e->kind;
+}
+
+int dialog_receive(dialog_handle_t *handle, dialog_view_t *view, int block) {
+    if (handle->count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    while (1) {
+        for (int k = 0; k < handle->count; k++) {
+            int i = (handle->next + k) % handle->count;
+            membership_t *m = &handle->members[i];
+            control_event_t e;
+            if (control_next(m->dialog, m->my_slot, &e)) {
+                handle->next = (i + 1) % handle->count;
+                control_view(view, m, &e);
+                return 1;
+            }
+            message_view_t v;
+            if (atomic_load_explicit(&m->dialog->paused, memory_order_relaxed)) continue;
+            if (!message_peek(m->dialog, m->my_slot, &m->view_seq, &v)) continue;
+
+            handle->next = (i + 1) % handle->count;
+            view->data = v.data;
+            view->length = v.length;
+            view->dialog_id = m->dialog_id;
+            view->sender_slot = v.sender_slot;
+            view->sender_pid = v.sender_pid;
+            view->seq = v.seq;
+            view->sent_ns = v.sent_ns;
+            view->stream_id = v.stream_id;
+            view->stream_offset = v.stream_offset;
+            view->stream_length = v.stream_length;
+            view->control = 0;
+            return 1;
+        }
+        if (!block) return 0;
+        dialog_wait_any(handle->members, handle->count, &handle->spin_budget); // wakes on a send to any of them
+    }
+}
+
+int dialog_ack(dialog_handle_t *handle, const dialog_view_t *view) {
+    int i = find_member(handle, view->dialog_id);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (view->control != 0) return 0;                            // it holds nothing in the dialog
+    membership_t *m = &handle->members[i];
+
+    message_view_t v = { view->seq, view->sent_ns, view->data, view->length, view->sender_slot, view->sender_pid,
+                         view->stream_id, view->stream_offset, view->stream_length, 0 };
+    if (message_release(m->dialog, m->my_slot, &v) != 0) {
+        errno = ESTALE;
+        return -1;
+    }
+    return 0;
+}
+
+/*  Sets stream up for the stream whose first fragment is view, with the payload going to buffer.
+*/
+static int stream_start(dialog_stream_t *stream, const dialog_view_t *view, char *buffer, int fd, size_t mapped) {
+    stream->dialog_id = view->dialog_id;
+    stream->sender_pid = view->sender_pid;
+    stream->stream_id = view->stream_id;
+    stream->length = view->stream_length;
+    stream->received = 0;
+    stream->buffer = buffer;
+    stream->fd = fd;
+    stream->mapped = mapped;
+    return dialog_stream_add(stream, view) == 1 ? 0 : -1;
+}
+
+int dialog_stream_begin(dialog_stream_t *stream, const dialog_view_t *view, void *buffer, size_t capacity) {
+    if (view->stream_id == 0 || view->stream_offset != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (capacity < view->stream_length) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return stream_start(stream, view, buffer, -1, 0);
+}
+
+int dialog_stream_begin_file(dialog_stream_t *stream, const dialog_view_t *view, const char *path) {
+    if (view->stream_id == 0 || view->stream_offset != 0 || view->stream_length > SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t length = (size_t)view->stream_length;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)length) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return stream_start(stream, view, map, fd, length);
+}
+
+int dialog_stream_add(dialog_stream_t *stream, const dialog_view_t *view) {
+    if (view->stream_id != stream->stream_id || view->sender_pid != stream->sender_pid ||
+        view->dialog_id != stream->dialog_id || view->stream_id == 0) return 0;
+    if (view->stream_offset != stream->received || view->length > stream->length - stream->received) {
+        errno = EIO;                                             // fragments of a sender arrive in order, so one is missing
+        return -1;
+    }
+    memcpy(stream->buffer + stream->received, view->data, view->length);
+    stream->received += view->length;
+    return 1;
+}
+
+int dialog_stream_end(dialog_stream_t *stream) {
+    if (stream->mapped > 0) {
+        munmap(stream->buffer, stream->mapped);                  // the page cache writes it back
+        close(stream->fd);
+        stream->mapped = 0;
+        stream->fd = -1;
+    }
+    if (stream->received != stream->length) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*  Releases the slot of member i and unregisters it, keeping the other members in order.
+*/
+static void leave_member(dialog_handle_t *handle, int i) {
+    membership_t *m = &handle->members[i];
+    lock_counted(&m->dialog->dialog_lock, &m->dialog->stats.lock);
+    leave_dialog(m->dialog, m->my_slot);
+    pthread_mutex_unlock(&m->dialog->dialog_lock);
+
+    for (int k = i; k + 1 < handle->count; k++) handle->members[k] = handle->members[k + 1];
+    handle->count--;
+    handle->next = 0;
+}
+
+int dialog_leave(dialog_handle_t *handle, int dialog_id) {
+    int i = find_member(handle, dialog_id);
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    leave_member(handle, i);
+
+    lock_counted(mutex, &handle->shared_mem->mutex_stats);
+    unregister_process(handle->shared_mem);
+    pthread_mutex_unlock(mutex);
+    return 0;
+}
+
+void dialog_close(dialog_handle_t *handle) {
+    int joined = handle->count;
+    while (handle->count > 0) leave_member(handle, handle->count - 1);
+
+    if (handle->shared_mem != NULL) {                            // NULL after a failed attach, with nothing joined
+        lock_counted(mutex, &handle->shared_mem->mutex_stats);
+        for (int i = 0; i < joined; i++) unregister_process(handle->shared_mem);
+        detach_shared_memory(handle->shared_mem, handle->shm_id); // removes the segment if we were the last
+    }
+
+    free(handle);
+    atomic_store(&opened, 0);
+}
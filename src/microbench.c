@@ -0,0 +1,387 @@
+/* microbench.c
+    Microbenchmarks of the hot paths: message_send, message_fetch, message_receive,
+    cleanup_read_messages, join_dialog and leave_dialog, each called in a tight loop by one thread.
+    They run against a segment in the private memory of the process (create_private_segment), so
+    no other process, no futex wait and no scheduler decision gets into the numbers. Every operation is
+    measured with 1, 16, 128 and 1000 reading participants in the dialog and with the ring 0%, 50% and
+    90% full before each batch, which is what its cost depends on.
+
+    Only the loops are timed. Putting the dialog back into the state of the case between two batches
+    (refilling the ring, rewinding a cursor) is not. Where the kernel allows it (perf_event_open, see
+    /proc/sys/kernel/perf_event_paranoid) the user-space cycles, instructions and cache misses of the
+    timed loops are counted as well.
+
+    The results go to stdout as tab-separated lines with a header line, one per operation and case:
+
+    op  readers  fill  ops  ns_per_op  cycles_per_op  instructions_per_op  cache_misses_per_op
+
+    fill is in percent of the ring. A counter that is not available is printed as "-". At fill 0 an
+    operation of fetch and receive is a call that finds nothing; otherwise it is one message received,
+    and one of cleanup_reclaim one message reclaimed.
+
+    Usage: ./microbench [-t ms_per_case] [-b msg_bytes] [-o op]
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "../include/dialog.h"
+
+#define ERROR_BAD_OPTION 1
+#define ERROR_SETUP 2
+#define COUNTERS 3
+#define MAX_BATCH 64                                             // operations timed between two resets
+#define MEMBERSHIP_BATCH 16                                      // joins, then leaves, per batch
+
+static const int reader_counts[] = { 1, 16, 128, 1000 };
+static const int fill_levels[] = { 0, 50, 90 };                  // percent of the ring
+
+/*  The hardware counters, opened as one group (the cycles lead) so that they count over exactly the
+    same time. fds: -1 for the ones the kernel did not give us.
+*/
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+static int counter_fds[COUNTERS] = { -1, -1, -1 };
+
+/*  What the timed loops of one case added up to.
+    ops / ns: operations done and the time they took
+    counts: the hardware counters over the same loops
+*/
+typedef struct {
+    uint64_t ops;
+    uint64_t ns;
+    uint64_t counts[COUNTERS];
+} sample_t;
+
+/*  The dialog of one reader count and its participants.
+    sender: a send-only slot, which sends every message and runs the cleanups of the benchmark
+    readers / reader_count: the reading slots; readers[0] is the one whose receiving is measured
+    target: the number of messages in the ring at the fill level of the current case
+*/
+typedef struct {
+    dialog_t *dialog;
+    int sender;
+    int readers[MAX_DIALOG_PARTICIPANTS];
+    int reader_count;
+    uint32_t target;
+} bench_dialog_t;
+
+static uint64_t budget_ns = 100 * 1000000ull;                    // timed nanoseconds per case (-t)
+static char text[MAX_MSG_SIZE + 1];                              // the message sent, -b bytes of 'x'
+static const char *only_op = NULL;                               // -o
+
+static long parse_positive(const char *s, const char *what) {
+    char *end = NULL;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v <= 0) {
+        fprintf(stderr, "Error: %s must be a positive integer\n", what);
+        exit(ERROR_BAD_OPTION);
+    }
+    return v;
+}
+
+/*  Opens the counters of the calling thread, disabled. Counting only user space keeps them usable at
+    perf_event_paranoid 2, the default of most distributions.
+*/
+static void open_counters(void) {
+    for (int i = 0; i < COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.disabled = i == 0;                                  // the members follow the leader
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counter_fds[0], 0);
+        if (counter_fds[0] < 0) {
+            fprintf(stderr, "microbench: no hardware counters (perf_event_open: %s)\n", strerror(errno));
+            return;
+        }
+    }
+}
+
+static void counters_ioctl(unsigned long request) {
+    if (counter_fds[0] >= 0) ioctl(counter_fds[0], request, PERF_IOC_FLAG_GROUP);
+}
+
+static uint64_t start_timing(void) {
+    counters_ioctl(PERF_EVENT_IOC_RESET);
+    counters_ioctl(PERF_EVENT_IOC_ENABLE);
+    return monotonic_ns();
+}
+
+static void stop_timing(sample_t *sample, uint64_t start, uint64_t ops) {
+    uint64_t end = monotonic_ns();
+    counters_ioctl(PERF_EVENT_IOC_DISABLE);
+    sample->ns += end - start;
+    sample->ops += ops;
+    for (int i = 0; i < COUNTERS; i++) {
+        uint64_t value = 0;
+        if (counter_fds[i] >= 0 && read(counter_fds[i], &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+            sample->counts[i] += value;
+        }
+    }
+}
+
+/*  Whether the case still needs time: until budget_ns of it was timed, or ten times that passed,
+    since the resets between the batches of some cases cost more than the batches.
+*/
+static int case_running(const sample_t *sample, uint64_t case_start) {
+    return sample->ns < budget_ns && monotonic_ns() - case_start < 10 * budget_ns;
+}
+
+static void print_per_op(uint64_t total, uint64_t ops, int available) {
+    if (available) printf("\t%.1f", (double)total / (double)ops);
+    else printf("\t-");
+}
+
+static void report(const char *op, const bench_dialog_t *b, int fill, const sample_t *sample) {
+    if (sample->ops == 0) return;
+    printf("%s\t%d\t%d\t%" PRIu64, op, b->reader_count, fill, sample->ops);
+    print_per_op(sample->ns, sample->ops, 1);
+    for (int i = 0; i < COUNTERS; i++) print_per_op(sample->counts[i], sample->ops, counter_fds[i] >= 0);
+    printf("\n");
+    fflush(stdout);
+}
+
+static int wanted(const char *op) {
+    return only_op == NULL || strcmp(only_op, op) == 0;
+}
+
+static void send_messages(bench_dialog_t *b, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (message_send(b->dialog, b->sender, text) != 0) {
+            fprintf(stderr, "Error: the dialog is full before %u messages are in (raise DIALOG_ARENA_SIZE "
+                            "or lower -b)\n", b->target);
+            exit(ERROR_SETUP);
+        }
+    }
+}
+
+/*  Lets every reader read all but the last keep messages and reclaims the rest.
+*/
+static void trim(bench_dialog_t *b, uint32_t keep) {
+    uint64_t cursor = atomic_load(&b->dialog->write_seq) - keep;
+    for (int i = 0; i < b->reader_count; i++) {
+        atomic_store(&dialog_cursors(b->dialog)[b->readers[i]].read_seq, cursor);
+    }
+    cleanup_read_messages(b->dialog, b->sender, 0);
+}
+
+/*  Leaves target messages in the ring, none of them read yet.
+*/
+static void set_fill(bench_dialog_t *b) {
+    trim(b, 0);
+    send_messages(b, b->target);
+}
+
+/*  Puts the read cursor of readers[0] back to the oldest message, refilling the ring if the
+    receive reclaimed it (when readers[0] is the only reader).
+*/
+static void rewind_reader(bench_dialog_t *b) {
+    dialog_t *dialog = b->dialog;
+    if (atomic_load(&dialog->write_seq) - atomic_load(&dialog->tail_seq) < b->target) set_fill(b);
+    atomic_store(&dialog_cursors(dialog)[b->readers[0]].read_seq, atomic_load(&dialog->tail_seq));
+}
+
+static void bench_send(bench_dialog_t *b, int fill) {
+    uint32_t room = b->dialog->ring_size - b->target;
+    uint32_t batch = room / 2 < MAX_BATCH ? room / 2 : MAX_BATCH;
+    if (batch == 0) batch = 1;
+    sample_t sample = { 0 };
+    set_fill(b);
+    for (uint64_t case_start = monotonic_ns(); case_running(&sample, case_start); ) {
+        uint64_t start = start_timing();
+        for (uint32_t i = 0; i < batch; i++) {
+            if (message_send(b->dialog, b->sender, text) != 0) exit(ERROR_SETUP);
+        }
+        stop_timing(&sample, start, batch);
+        trim(b, b->target);
+    }
+    report("send", b, fill, &sample);
+}
+
+static void bench_fetch(bench_dialog_t *b, int fill) {
+    static received_message_t out;
+    sample_t sample = { 0 };
+    set_fill(b);
+    for (uint64_t case_start = monotonic_ns(); case_running(&sample, case_start); ) {
+        uint64_t start = start_timing();
+        uint64_t n = 0;
+        if (b->target == 0) {
+            for (n = 0; n < MAX_BATCH; n++) message_fetch(b->dialog, b->readers[0], &out);
+        }
+        else {
+            while (message_fetch(b->dialog, b->readers[0], &out) == 1) n++;
+        }
+        stop_timing(&sample, start, n);
+        rewind_reader(b);
+    }
+    report("fetch", b, fill, &sample);
+}
+
+/*  message_receive prints what it receives, so stdout goes to /dev/null meanwhile: the write() of
+    every batch is part of the operation, as it is for ./dialog.
+*/
+static void bench_receive(bench_dialog_t *b, int fill) {
+    sample_t sample = { 0 };
+    set_fill(b);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("microbench: /dev/null");
+        exit(ERROR_SETUP);
+    }
+    for (uint64_t case_start = monotonic_ns(); case_running(&sample, case_start); ) {
+        uint64_t start = start_timing();
+        uint64_t n = 0;
+        if (b->target == 0) {
+            for (n = 0; n < MAX_BATCH; n++) message_receive(b->dialog, b->readers[0], NULL);
+        }
+        else {
+            n = (uint64_t)message_receive(b->dialog, b->readers[0], NULL);
+        }
+        stop_timing(&sample, start, n);
+        rewind_reader(b);
+    }
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null_fd);
+    report("receive", b, fill, &sample);
+}
+
+/*  A cleanup that can not reclaim anything: readers[0] has read nothing and the others are spread
+    over the ring, so it collects and sorts every cursor and stops at the first message. This is what
+    the receivers pay on every call while one of them lags.
+*/
+static void bench_cleanup_scan(bench_dialog_t *b, int fill) {
+    sample_t sample = { 0 };
+    set_fill(b);
+    uint64_t tail = atomic_load(&b->dialog->tail_seq);
+    for (int i = 0; i < b->reader_count; i++) {
+        uint64_t cursor = tail + (uint64_t)b->target * (uint64_t)i / (uint64_t)b->reader_count;
+        atomic_store(&dialog_cursors(b->dialog)[b->readers[i]].read_seq, cursor);
+    }
+    for (uint64_t case_start = monotonic_ns(); case_running(&sample, case_start); ) {
+        uint64_t start = start_timing();
+        for (int i = 0; i < MAX_BATCH; i++) cleanup_read_messages(b->dialog, b->sender, 0);
+        stop_timing(&sample, start, MAX_BATCH);
+    }
+    report("cleanup_scan", b, fill, &sample);
+}
+
+/*  A cleanup that reclaims the whole ring, every reader having read it: one operation per message.
+*/
+static void bench_cleanup_reclaim(bench_dialog_t *b, int fill) {
+    if (b->target == 0) return;
+    sample_t sample = { 0 };
+    for (uint64_t case_start = monotonic_ns(); case_running(&sample, case_start); ) {
+        set_fill(b);
+        uint64_t write = atomic_load(&b->dialog->write_seq);
+        for (int i = 0; i < b->reader_count; i++) {
+            atomic_store(&dialog_cursors(b->dialog)[b->readers[i]].read_seq, write);
+        }
+        uint64_t start = start_timing();
+        uint64_t n = cleanup_read_messages(b->dialog, b->sender, 0);
+        stop_timing(&sample, start, n);
+    }
+    report("cleanup_reclaim", b, fill, &sample);
+}
+
+/*  Joins and then leaves as many slots as are free (at most MEMBERSHIP_BATCH) per batch, with the
+    dialog_lock held, as ./dialog calls them. A join reaps dead participants first, which looks at
+    the process of every occupied slot, so it grows with the readers.
+*/
+static void bench_membership(bench_dialog_t *b) {
+    int free_slots = (int)b->dialog->max_participants - b->reader_count - 1;
+    int batch = free_slots < MEMBERSHIP_BATCH ? free_slots : MEMBERSHIP_BATCH;
+    if (batch <= 0) return;
+    int slots[MEMBERSHIP_BATCH];
+    pid_t me = getpid();
+    sample_t joins = { 0 }, leaves = { 0 };
+    trim(b, 0);
+    for (uint64_t case_start = monotonic_ns(); case_running(&joins, case_start); ) {
+        lock_counted(&b->dialog->dialog_lock, &b->dialog->stats.lock);
+        uint64_t start = start_timing();
+        for (int i = 0; i < batch; i++) slots[i] = join_dialog(b->dialog, me, SLOT_READER);
+        stop_timing(&joins, start, (uint64_t)batch);
+        start = start_timing();
+        for (int i = 0; i < batch; i++) leave_dialog(b->dialog, slots[i]);
+        stop_timing(&leaves, start, (uint64_t)batch);
+        pthread_mutex_unlock(&b->dialog->dialog_lock);
+    }
+    if (wanted("join")) report("join", b, 0, &joins);
+    if (wanted("leave")) report("leave", b, 0, &leaves);
+}
+
+static void setup_dialog(shared_memory_t *shared_mem, const dialog_config_t *cfg, int dialog_id,
+                         int readers, bench_dialog_t *b) {
+    b->dialog = prepare_dialog(shared_mem, dialog_id);
+    b->reader_count = readers;
+    b->target = 0;
+    pid_t me = getpid();
+    lock_counted(&b->dialog->dialog_lock, &b->dialog->stats.lock);
+    activate_dialog(b->dialog, dialog_id, cfg);
+    b->sender = join_dialog(b->dialog, me, SLOT_SEND_ONLY);
+    for (int i = 0; i < readers; i++) b->readers[i] = join_dialog(b->dialog, me, SLOT_READER);
+    pthread_mutex_unlock(&b->dialog->dialog_lock);
+}
+
+int main(int argc, char *argv[]) {
+    long msg_bytes = 32;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:o:")) != -1) {
+        switch (opt) {
+            case 't': budget_ns = (uint64_t)parse_positive(optarg, "ms per case") * 1000000ull; break;
+            case 'b': msg_bytes = parse_positive(optarg, "message bytes"); break;
+            case 'o': only_op = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-t ms_per_case] [-b msg_bytes] [-o op]\n", argv[0]);
+                exit(ERROR_BAD_OPTION);
+        }
+    }
+
+    // The capacities of the DIALOG_* variables, except that every dialog has room for the largest
+    // reader count and nothing is journaled: the disk is not what is measured here.
+    dialog_config_t cfg;
+    load_config(&cfg);
+    cfg.max_dialogs = (uint32_t)(sizeof(reader_counts) / sizeof(reader_counts[0]));
+    cfg.max_participants = MAX_DIALOG_PARTICIPANTS;
+    cfg.journal_dir = NULL;
+    cfg.replay = 0;
+    if (msg_bytes > (long)cfg.max_msg_size) msg_bytes = (long)cfg.max_msg_size;
+    memset(text, 'x', (size_t)msg_bytes);
+
+    shared_memory_t *shared_mem = create_private_segment(&cfg);
+    open_counters();
+
+    printf("op\treaders\tfill\tops\tns_per_op\tcycles_per_op\tinstructions_per_op\tcache_misses_per_op\n");
+    static bench_dialog_t b;                                     // the slot list is too big for the stack
+    for (int d = 0; d < (int)cfg.max_dialogs; d++) {
+        setup_dialog(shared_mem, &cfg, d, reader_counts[d], &b);
+        for (size_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+            int fill = fill_levels[f];
+            b.target = (uint32_t)((uint64_t)b.dialog->ring_size * (uint64_t)fill / 100);
+            if (wanted("send")) bench_send(&b, fill);
+            if (wanted("fetch")) bench_fetch(&b, fill);
+            if (wanted("receive")) bench_receive(&b, fill);
+            if (wanted("cleanup_scan")) bench_cleanup_scan(&b, fill);
+            if (wanted("cleanup_reclaim")) bench_cleanup_reclaim(&b, fill);
+        }
+        b.target = 0;
+        if (wanted("join") || wanted("leave")) bench_membership(&b);
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+/* notify.c */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../include/notify.h"
+#include "../include/threads.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()                       // tell the core we are spinning
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+/*  The futex word lives in shared memory and is used by many processes, so the
+    non-private futex operations are used on purpose.
+*/
+static void futex_wait(_Atomic uint32_t *word, uint32_t expected, const struct timespec *timeout) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, timeout, NULL, 0); // returns at once if *word != expected
+}
+
+#if !defined(SYS_futex_waitv) && defined(__NR_futex_waitv)
+#define SYS_futex_waitv __NR_futex_waitv
+#endif
+
+/*  Sleeps until one of the n words differs from its value in the waiters, or until it is woken.
+    It returns -1 with errno ENOSYS if the kernel (or these headers) have no futex_waitv.
+*/
+static int futex_wait_multiple(struct futex_waitv *waiters, unsigned n) {
+#ifdef SYS_futex_waitv
+    return (int)syscall(SYS_futex_waitv, waiters, n, 0, NULL, 0); // no timeout
+#else
+    (void)waiters;
+    (void)n;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void futex_wake_all(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void dialog_notify(dialog_t *dialog) {
+    // The seq_cst increment and the seq_cst load below pair with the ones in dialog_wait:
+    // either this writer sees the sleeper, or the sleeper sees the new value and does not sleep.
+    atomic_fetch_add(&dialog->notify_word, 1);
+    if (atomic_load(&dialog->sleepers) > 0) {
+        futex_wake_all(&dialog->notify_word);                    // one syscall wakes every reader of the dialog
+        atomic_fetch_add_explicit(&dialog->stats.wakeups, 1, memory_order_relaxed);
+    }
+}
+
+void dialog_wait(dialog_t *dialog, int my_slot, int *spin_budget) {
+    static int cpu_count = 0;
+    if (cpu_count == 0) cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    uint32_t seen = atomic_load(&dialog->notify_word);
+    if (message_pending(dialog, my_slot)) return;
+
+    if (cpu_count > 1) {                                         // spinning on one CPU only delays the writer
+        for (int i = 0; i < *spin_budget; i++) {
+            if (atomic_load_explicit(&dialog->notify_word, memory_order_acquire) != seen ||
+                message_pending(dialog, my_slot)) {
+                if (*spin_budget < MAX_SPIN_ITERATIONS) *spin_budget *= 2; // spinning paid off, allow more next time
+                return;
+            }
+            cpu_relax();
+        }
+    }
+    if (*spin_budget > 16) *spin_budget /= 2;                    // spinning did not help, back off
+
+    atomic_fetch_add(&dialog->sleepers, 1);
+    if (atomic_load(&dialog->notify_word) == seen && !message_pending(dialog, my_slot)) {
+        futex_wait(&dialog->notify_word, seen, NULL);            // sleep until a writer bumps the word
+        stat_add(&dialog_slot_stats(dialog)[my_slot].sleeps, 1);
+    }
+    atomic_fetch_sub(&dialog->sleepers, 1);
+}
+
+/*  Returns 1 if the word of an active member moved away from seen or it has a pending message.
+*/
+static int any_ready(membership_t *members, int count, const uint32_t *seen) {
+    for (int i = 0; i < count; i++) {
+        if (!members[i].active) continue;
+        if (atomic_load(&members[i].dialog->notify_word) != seen[i] || member_pending(&members[i])) return 1;
+    }
+    return 0;
+}
+
+void dialog_wait_any(membership_t *members, int count, int *spin_budget) {
+    static int cpu_count = 0;
+    static int have_waitv = 1;                                   // cleared on the first ENOSYS
+    if (cpu_count == 0) cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    uint32_t seen[MAX_JOINED_DIALOGS];
+    for (int i = 0; i < count; i++) seen[i] = atomic_load(&members[i].dialog->notify_word);
+    if (any_ready(members, count, seen)) return;
+
+    if (cpu_count > 1) {
+        for (int i = 0; i < *spin_budget; i++) {
+            if (any_ready(members, count, seen)) {
+                if (*spin_budget < MAX_SPIN_ITERATIONS) *spin_budget *= 2;
+                return;
+            }
+            cpu_relax();
+        }
+    }
+    if (*spin_budget > 16) *spin_budget /= 2;
+
+    // The same sleepers protocol as dialog_wait, once per dialog: after the increments a sender of
+    // any of them either sees us as a sleeper or we see its new word value below.
+    for (int i = 0; i < count; i++) {
+        if (members[i].active) atomic_fetch_add(&members[i].dialog->sleepers, 1);
+    }
+    if (!any_ready(members, count, seen)) {
+        struct futex_waitv waiters[MAX_JOINED_DIALOGS];
+        unsigned n = 0;
+        for (int i = 0; i < count; i++) {
+            if (!members[i].active) continue;
+            waiters[n].val = seen[i];
+            waiters[n].uaddr = (uint64_t)(uintptr_t)&members[i].dialog->notify_word;
+            waiters[n].flags = FUTEX_32;                         // shared: the words are in shared memory
+            waiters[n].__reserved = 0;
+            n++;
+        }
+        if (n > 0 && have_waitv && futex_wait_multiple(waiters, n) < 0 && errno == ENOSYS) have_waitv = 0;
+        if (n > 0 && !have_waitv) {
+            // Without futex_waitv we sleep on the words in turn, so a message for another dialog
+            // waits at most one slice.
+            static unsigned turn = 0;
+            struct timespec slice = { 0, WAIT_ANY_SLICE_MS * 1000000L };
+            struct futex_waitv *w = &waiters[turn++ % n];
+            futex_wait((_Atomic uint32_t*)(uintptr_t)w->uaddr, (uint32_t)w->val, &slice);
+        }
+        for (int i = 0; i < count; i++) {
+            if (members[i].active) stat_add(&dialog_slot_stats(members[i].dialog)[members[i].my_slot].sleeps, 1);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (members[i].active) atomic_fetch_sub(&members[i].dialog->sleepers, 1);
+    }
+}
+
+void dialog_notify_space(dialog_t *dialog) {
+    atomic_fetch_add(&dialog->space_word, 1);                    // pairs with dialog_wait_space, as above
+    if (atomic_load(&dialog->space_waiters) > 0) {
+        futex_wake_all(&dialog->space_word);
+    }
+}
+
+void dialog_wait_space(dialog_t *dialog, uint32_t seen, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+
+    atomic_fetch_add(&dialog->space_waiters, 1);
+    if (atomic_load(&dialog->space_word) == seen) {
+        futex_wait(&dialog->space_word, seen, &timeout);         // relative timeout
+    }
+    atomic_fetch_sub(&dialog->space_waiters, 1);
+}
+
+void dialog_notify_journal(dialog_t *dialog) {
+    atomic_fetch_add(&dialog->journal_word, 1);
+    if (atomic_load(&dialog->journal_waiters) > 0) {
+        futex_wake_all(&dialog->journal_word);
+    }
+}
+
+void dialog_wait_journal(dialog_t *dialog, uint32_t seen, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+
+    atomic_fetch_add(&dialog->journal_waiters, 1);
+    if (atomic_load(&dialog->journal_word) == seen) {
+        futex_wait(&dialog->journal_word, seen, &timeout);
+    }
+    atomic_fetch_sub(&dialog->journal_waiters, 1);
+}
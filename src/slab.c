@@ -0,0 +1,187 @@
+/* slab.c */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/slab.h"
+
+static int size_class(uint32_t len) {
+    int c = 0;
+    while (((uint32_t)SLAB_MIN_BLOCK << c) < len) c++;           // smallest class that fits len
+    return c;
+}
+
+static uint32_t class_size(int c) {
+    return (uint32_t)SLAB_MIN_BLOCK << c;
+}
+
+static void push_block(slab_t *slab, char *arena, int c, uint32_t off) {
+    _Atomic uint64_t *head = &slab->free_head[c];
+    uint64_t old = atomic_load_explicit(head, memory_order_relaxed);
+    uint64_t new_head;
+
+    do {
+        uint32_t next = (uint32_t)old;                           // (offset + 1) of the current first block
+        memcpy(arena + off, &next, sizeof(next));                // link the block in front of it
+        new_head = ((old >> 32) + 1) << 32 | (uint64_t)(off + 1);
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, new_head,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+static int pop_block(slab_t *slab, char *arena, int c, uint32_t *out_off) {
+    _Atomic uint64_t *head = &slab->free_head[c];
+    uint64_t old = atomic_load_explicit(head, memory_order_acquire);
+    uint64_t new_head;
+
+    do {
+        uint32_t first = (uint32_t)old;
+        if (first == 0) return -1;                               // class is empty
+        uint32_t next;
+        memcpy(&next, arena + first - 1, sizeof(next));          // may be stale, the tag makes the CAS fail then
+        new_head = ((old >> 32) + 1) << 32 | (uint64_t)next;
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, new_head,
+                                                    memory_order_acquire, memory_order_acquire));
+
+    *out_off = (uint32_t)old - 1;
+    return 0;
+}
+
+/*  Takes the whole free list of class c at once and returns (offset + 1) of its first block, or 0
+    if it was empty. The blocks are ours afterwards: a pop_block that read the old head fails on the tag.
+*/
+static uint32_t take_list(slab_t *slab, int c) {
+    _Atomic uint64_t *head = &slab->free_head[c];
+    uint64_t old = atomic_load_explicit(head, memory_order_acquire);
+
+    do {
+        if ((uint32_t)old == 0) return 0;
+    } while (!atomic_compare_exchange_weak_explicit(head, &old, ((old >> 32) + 1) << 32,
+                                                    memory_order_acquire, memory_order_acquire));
+    return (uint32_t)old;
+}
+
+/*  Sets the bits of count units (of SLAB_MIN_BLOCK bytes) from unit first on, a word at a time.
+*/
+static void mark_units(uint64_t *bits, uint32_t first, uint32_t count) {
+    uint32_t end = first + count;
+    while (first < end) {
+        uint32_t bit = first % 64;
+        uint32_t n = end - first < 64 - bit ? end - first : 64 - bit;
+        bits[first / 64] |= (n == 64 ? UINT64_MAX : ((uint64_t)1 << n) - 1) << bit;
+        first += n;
+    }
+}
+
+/*  Gives a run of len free bytes at off back: to the uncarved part of the arena if it ends where
+    that starts, otherwise as the largest blocks that fit in it.
+*/
+static void give_back(slab_t *slab, char *arena, uint32_t off, uint32_t len) {
+    uint32_t bump = off + len;
+    if (atomic_compare_exchange_strong_explicit(&slab->bump, &bump, off, memory_order_relaxed, memory_order_relaxed)) return;
+
+    while (len > 0) {
+        int c = SLAB_CLASSES - 1;
+        while (class_size(c) > len) c--;
+        push_block(slab, arena, c, off);
+        off += class_size(c);
+        len -= class_size(c);
+    }
+}
+
+/*  Merges the free blocks of every class with their free neighbours. The free lists are taken
+    whole, the blocks in them are marked in a bitmap of the arena and every run of adjacent free
+    units is given back in as few blocks as possible. Blocks freed meanwhile simply wait in the lists
+    for the next time. It returns 0 if there was nothing free to merge.
+*/
+static int coalesce(slab_t *slab, char *arena) {
+    uint32_t firsts[SLAB_CLASSES];
+    int any = 0;
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        firsts[c] = take_list(slab, c);
+        any |= firsts[c] != 0;
+    }
+    if (!any) return 0;
+
+    uint32_t units = slab->arena_size / SLAB_MIN_BLOCK;
+    uint64_t *free_units = calloc((units + 63) / 64, sizeof(uint64_t)); // in the memory of this process only
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        for (uint32_t b = firsts[c]; b != 0; ) {
+            uint32_t off = b - 1;
+            memcpy(&b, arena + off, sizeof(b));                  // the next block, before the block is given away
+            if (free_units) mark_units(free_units, off / SLAB_MIN_BLOCK, class_size(c) / SLAB_MIN_BLOCK);
+            else push_block(slab, arena, c, off);                // no memory for the bitmap: put it back as it was
+        }
+    }
+    if (!free_units) return 0;
+
+    uint32_t u = 0;
+    while (u < units) {
+        uint64_t word = free_units[u / 64];
+        if (u % 64 == 0 && word == 0) {                          // nothing free in these 64 units
+            u += 64;
+            continue;
+        }
+        if (!(word >> (u % 64) & 1)) {
+            u++;
+            continue;
+        }
+        uint32_t start = u;
+        while (u < units && (free_units[u / 64] >> (u % 64) & 1)) {
+            u += u % 64 == 0 && free_units[u / 64] == UINT64_MAX ? 64 : 1;
+        }
+        give_back(slab, arena, start * SLAB_MIN_BLOCK, (u - start) * SLAB_MIN_BLOCK);
+    }
+    free(free_units);
+    return 1;
+}
+
+/*  Allocates a block of class c from the free lists or the uncarved part of the arena, without merging.
+*/
+static int alloc_class(slab_t *slab, char *arena, int c, uint32_t *out_off) {
+    if (pop_block(slab, arena, c, out_off) == 0) return 0;       // fast path: reuse a freed block
+
+    // Carve a fresh block from the part of the arena no class owns yet.
+    uint32_t size = class_size(c);
+    uint32_t bump = atomic_load_explicit(&slab->bump, memory_order_relaxed);
+    while (bump + size <= slab->arena_size) {
+        if (atomic_compare_exchange_weak_explicit(&slab->bump, &bump, bump + size,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            *out_off = bump;
+            return 0;
+        }
+    }
+
+    // Arena exhausted: split a free block of the next bigger class that has one. The upper
+    // halves are given to the classes in between, the lowest piece is ours.
+    for (int big = c + 1; big < SLAB_CLASSES; big++) {
+        uint32_t off;
+        if (pop_block(slab, arena, big, &off) != 0) continue;
+        for (int k = big - 1; k >= c; k--) {
+            push_block(slab, arena, k, off + class_size(k));
+        }
+        *out_off = off;
+        return 0;
+    }
+
+    return -1;
+}
+
+int slab_alloc(slab_t *slab, char *arena, uint32_t len, uint32_t *out_off) {
+    if (len == 0 || len > SLAB_MAX_BLOCK) return -1;
+    int c = size_class(len);
+
+    if (alloc_class(slab, arena, c, out_off) == 0) return 0;
+
+    // What is free is only in blocks smaller than ours (or nothing is free at all): merge them
+    // with their free neighbours and try once more.
+    if (coalesce(slab, arena) && alloc_class(slab, arena, c, out_off) == 0) return 0;
+    return -1;
+}
+
+void slab_free(slab_t *slab, char *arena, uint32_t off, uint32_t len) {
+    push_block(slab, arena, size_class(len), off);
+}
+
+uint32_t slab_block_size(uint32_t len) {
+    return class_size(size_class(len));
+}
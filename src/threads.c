@@ -1,181 +1,966 @@
 /* threads.c */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include "../include/journal.h"
+#include "../include/notify.h"
 #include "../include/threads.h"
 #include "../include/utils.h"
 
 #include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
 
 #define ERROR_LIMIT_REACHED 5
+#define ERROR_MSG_SIZE 6
+
+#define OUTPUT_BATCH_SIZE (64 * 1024)                            // bytes of output the reader collects before writing
+#define MAX_LINE_OVERHEAD 64                                     // "[dialog ..] (slot .., pid ..): " plus the newline
+
+_Static_assert(OUTPUT_BATCH_SIZE >= MAX_MSG_SIZE + MAX_LINE_OVERHEAD, "a single message must fit in the output batch");
+
+#define INPUT_BLOCK_SIZE (64 * 1024)                             // bytes of stdin the writer reads at once
+#define SPACE_WAIT_SLICE_MS 10                                   // longest sleep of a sender in a full dialog
+#define STREAM_YIELDS 64                                         // times a stream sender yields before it sleeps
+
+_Static_assert(INPUT_BLOCK_SIZE >= MAX_MSG_SIZE, "a whole message must fit in the input block");
+
+/*  A reading slot and its read cursor, as collected by the cleanup.
+*/
+typedef struct {
+    uint64_t cursor;
+    int slot;
+} reader_cursor_t;
 
-static void trim_newline(char *s) {
-    if (!s) return;
-    size_t n = strlen(s);
-    if (n == 0) return;
-    if (s[n - 1] == '\n') s[n - 1] = '\0';
+static int by_cursor(const void *a, const void *b) {
+    uint64_t x = ((const reader_cursor_t*)a)->cursor, y = ((const reader_cursor_t*)b)->cursor;
+    return (x > y) - (x < y);
 }
 
-static void cleanup_read_messages(dialog_t *dialog) {
-    for (int i = 0; i < MAX_MSGS_PER_DIALOG; i++) {
-        message_t *m = &dialog->messages[i];
-        if (!m->message_exists) continue;
+uint64_t cleanup_read_messages(dialog_t *dialog, int my_slot, uint64_t pressure) {
+    int idle = 0;
+    if (!atomic_compare_exchange_strong_explicit(&dialog->reclaiming, &idle, my_slot + 1,
+                                                 memory_order_acquire, memory_order_relaxed)) return 0;
+
+    uint64_t write = atomic_load_explicit(&dialog->write_seq, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&dialog->tail_seq, memory_order_relaxed);
+    uint64_t start = tail;
+    int skip_lagging = pressure && dialog->backpressure == BACKPRESSURE_SKIP_LAGGING;
+    uint64_t forced = pressure && dialog->backpressure == BACKPRESSURE_DROP_OLDEST ? tail + pressure : tail; // make room for the sender
+
+    // The cursors of the reading slots that have not read up to write yet, in ascending order, so that
+    // the set of readers that have not passed the message at tail only grows while tail advances.
+    // Readers that have caught up can not hold back anything, however many there are.
+    reader_cursor_t readers[MAX_DIALOG_PARTICIPANTS];
+    uint64_t lagging[PARTICIPANT_WORDS] = { 0 };                 // too far behind to wait for
+    uint32_t words = dialog->participant_words;
+    int n = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t mask = atomic_load_explicit(&dialog->reader_mask[w], memory_order_acquire);
+        while (mask) {                                           // visit only the slots that read
+            int s = (int)w * 64 + __builtin_ctzll(mask);
+            mask &= mask - 1;
+            uint64_t cursor = atomic_load_explicit(&dialog_cursors(dialog)[s].read_seq, memory_order_acquire);
+            if (cursor >= write) continue;
+            if (skip_lagging && write - cursor > dialog->lag_limit) lagging[w] |= (uint64_t)1 << (s % 64);
+            readers[n].cursor = cursor;
+            readers[n].slot = s;
+            n++;
+        }
+    }
+    if (n > 1) qsort(readers, (size_t)n, sizeof(readers[0]), by_cursor);
+
+    int next = 0;
+    uint64_t behind[PARTICIPANT_WORDS] = { 0 };                  // readers whose cursor is at or below tail
+    int behind_count = 0;
+    int holding = 0;                                             // the ones of them that are not lagging
+    for (; tail < write; tail++) {
+        while (next < n && readers[next].cursor <= tail) {
+            int s = readers[next++].slot;
+            behind[s / 64] |= (uint64_t)1 << (s % 64);
+            behind_count++;
+            if (!(lagging[s / 64] >> (s % 64) & 1)) holding++;
+        }
 
-        int all_read = 1;
-        for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-            if (!dialog->slot_used[s]) continue;                 // ignore inactive slots
-            if (!m->has_been_read_by[s]) {                       // at least one active participant hasn't read it yet
-                all_read = 0;
-                break;
+        message_t *m = &dialog_messages(dialog)[tail & dialog->ring_mask];
+        uint32_t published = MSG_CELL_SEQ(tail);
+        uint32_t seq = atomic_load_explicit(&m->seq, memory_order_acquire);
+        if (seq == (published | MSG_SEQ_RECLAIMED)) continue;    // released by a cleanup that died before moving the tail
+        if (seq != published) break;                             // reserved but not published yet
+
+        // Whether some recipients have not read it yet, and whether one of them is not lagging.
+        // A broadcast is for every reader, so the counts answer that without looking at the bitmaps.
+        const uint64_t *to = NULL;
+        int waiting = 0, held = 0;
+        if (behind_count > 0 && m->recipient_words == 0) {
+            waiting = 1;
+            held = holding > 0;
+        }
+        else if (behind_count > 0 && m->recipient_words <= words) {
+            to = message_recipients(dialog, m->payload_off, m->payload_len);
+            for (uint32_t w = 0; w < m->recipient_words; w++) {
+                uint64_t wait = to[w] & behind[w];
+                waiting |= wait != 0;
+                held |= (wait & ~lagging[w]) != 0;
             }
         }
+        if (held && tail >= forced) break;
+        if (dialog->journal_enabled && journal_append(dialog, m, tail) != 0) break; // staged for the journal first, or it waits
+        if (waiting) {                                           // the policy takes it away from them
+            stat_add(&dialog->stats.dropped, 1);
+            for (uint32_t w = 0; w < words; w++) {
+                uint64_t wait = behind[w] & (to ? (w < m->recipient_words ? to[w] : 0) : UINT64_MAX);
+                while (wait) {
+                    stat_add(&dialog_slot_stats(dialog)[w * 64 + (uint32_t)__builtin_ctzll(wait)].skipped, 1);
+                    wait &= wait - 1;
+                }
+            }
+        }
+
+        atomic_store_explicit(&m->seq, published | MSG_SEQ_RECLAIMED, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);               // lapped readers see the mark before the block is reused
+        if (m->payload_len > 0) {                                // not for abandoned cells
+            slab_free(&dialog->slab, dialog_payloads(dialog), m->payload_off,
+                      message_block_len(m->payload_len, m->recipient_words));
+        }
+    }
+
+    atomic_store_explicit(&dialog->tail_seq, tail, memory_order_release);
+    atomic_store_explicit(&dialog->reclaiming, 0, memory_order_release);
+
+    if (tail > start) dialog_notify_space(dialog);               // wake senders waiting for room
+    return tail - start;
+}
+
+/*  Where the messages of a batch go in a stream (see message_send_stream): the stream, the offset of
+    the first message in the payload and the length of the whole payload. The others follow it.
+*/
+typedef struct {
+    uint32_t id;
+    uint64_t offset;
+    uint64_t length;
+} stream_part_t;
+
+/*  The body of message_send_batch. If stream is not NULL the messages are fragments of that stream,
+    and *first_seq receives the sequence number of the first one published. hops, if not NULL, holds
+    the hop count of every message (message_relay_batch).
+*/
+static int publish_batch(dialog_t *dialog, int my_slot, const char *const *texts, const uint32_t *lens,
+                         const slot_set_t *const *recipients, const uint32_t *hops, int count,
+                         const stream_part_t *stream, uint64_t *first_seq) {
+    uint32_t offs[MAX_SEND_BATCH];
+    uint32_t blocks[MAX_SEND_BATCH];
+    uint32_t words = dialog->participant_words;
+    if (count > MAX_SEND_BATCH) count = MAX_SEND_BATCH;
+
+    // The payloads are allocated first, so that a full arena does not leave reserved but
+    // never published sequence numbers behind. We keep as many as the arena can take.
+    // When the arena is full we reclaim what the policy of the dialog allows and retry, as long
+    // as that frees something (and at least once, another process may be reclaiming right now).
+    // The recipient bitmap of a directed message goes into the same block, after the text.
+    int allocated = 0;
+    int reclaimed = 0;
+    while (allocated < count) {
+        const slot_set_t *to = recipients ? recipients[allocated] : NULL;
+        blocks[allocated] = message_block_len(lens[allocated], to ? words : 0);
+        if (lens[allocated] == 0 || lens[allocated] > dialog->max_msg_size || blocks[allocated] > SLAB_MAX_BLOCK ||
+            slab_block_size(blocks[allocated]) > dialog->slab.arena_size) { // would not fit even in an empty arena
+            if (allocated == 0) return -1;
+            break;                                               // the next call reports it
+        }
+        if (slab_alloc(&dialog->slab, dialog_payloads(dialog), blocks[allocated], &offs[allocated]) == 0) {
+            char *payload = dialog_payloads(dialog) + offs[allocated];
+            memcpy(payload, texts[allocated], lens[allocated]);
+            if (to) memcpy(payload + ((lens[allocated] + 7) & ~7u), to->words, words * sizeof(uint64_t));
+            allocated++;
+        }
+        else if (cleanup_read_messages(dialog, my_slot, (uint64_t)(count - allocated)) > 0 || !reclaimed) {
+            reclaimed = 1;
+        }
+        else break;
+    }
+    if (allocated == 0) {
+        stat_add(&dialog_slot_stats(dialog)[my_slot].full, 1);
+        reap_if_due(dialog);                                     // a dead reader may be what keeps the dialog full
+        return 0;
+    }
+
+    // Reserve up to 'allocated' consecutive sequence numbers with a single compare-and-swap.
+    uint64_t pos = atomic_load_explicit(&dialog->write_seq, memory_order_relaxed);
+    uint64_t take;
+
+    while (1) {
+        uint64_t room = dialog->ring_size - (pos - atomic_load_explicit(&dialog->tail_seq, memory_order_acquire));
+        if (room == 0) {
+            cleanup_read_messages(dialog, my_slot, (uint64_t)allocated); // try to reclaim before giving up
+            room = dialog->ring_size - (pos - atomic_load_explicit(&dialog->tail_seq, memory_order_acquire));
+        }
+        take = room < (uint64_t)allocated ? room : (uint64_t)allocated;
+        if (take == 0) break;                                    // mailbox full, the caller decides what to do
+        if (atomic_compare_exchange_weak_explicit(&dialog->write_seq, &pos, pos + take,
+                                                  memory_order_acq_rel, memory_order_relaxed)) break; // pos.. are ours
+    }
+
+    for (int i = (int)take; i < allocated; i++) {                // payloads that did not get a cell
+        slab_free(&dialog->slab, dialog_payloads(dialog), offs[i], blocks[i]);
+    }
+    if (take < (uint64_t)allocated) reap_if_due(dialog);
+
+    // If we die before publishing, the reaper publishes empty messages in these cells instead.
+    atomic_store_explicit(&dialog_cursors(dialog)[my_slot].pending_seq, pos, memory_order_relaxed);
+    atomic_store_explicit(&dialog_cursors(dialog)[my_slot].pending_count, (uint32_t)take, memory_order_relaxed);
+
+    // The cells of pos .. pos + take - 1 are ours alone: their previous laps are below tail_seq,
+    // so the cleanup has already released them. The whole batch gets one timestamp.
+    uint64_t now = monotonic_ns();
+    uint64_t stream_offset = stream ? stream->offset : 0;
+    if (first_seq) *first_seq = pos;
+    for (uint64_t i = 0; i < take; i++) {
+        message_t *m = &dialog_messages(dialog)[(pos + i) & dialog->ring_mask];
+
+        atomic_store_explicit(&m->seq, 0, memory_order_relaxed); // readers treat the cell as "being written"
+        atomic_thread_fence(memory_order_release);
+
+        m->payload_off = offs[i];
+        m->payload_len = (uint16_t)lens[i];
+        m->sender_slot = (uint16_t)my_slot;
+        m->sender_pid = dialog_cursors(dialog)[my_slot].pid;
+        m->recipient_words = recipients && recipients[i] ? words : 0;
+        m->sent_ns = now;
+        m->hops = hops ? hops[i] : 0;
+        m->stream_id = stream ? stream->id : 0;
+        m->stream_offset = stream_offset;
+        m->stream_length = stream ? stream->length : 0;
+        if (stream) stream_offset += lens[i];
+
+        atomic_store_explicit(&m->seq, MSG_CELL_SEQ(pos + i), memory_order_release); // publish: readers may now consume it
+    }
+    atomic_store_explicit(&dialog_cursors(dialog)[my_slot].pending_count, 0, memory_order_relaxed);
+
+    slot_stats_t *stats = &dialog_slot_stats(dialog)[my_slot];
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < take; i++) bytes += lens[i];
+    stat_add(&stats->sent, take);
+    stat_add(&stats->sent_bytes, bytes);
+    if ((int)take < count) stat_add(&stats->full, 1);            // the rest of the batch found the dialog full
+
+    return (int)take;
+}
+
+int message_send_batch(dialog_t *dialog, int my_slot, const char *const *texts, const uint32_t *lens,
+                       const slot_set_t *const *recipients, int count) {
+    return publish_batch(dialog, my_slot, texts, lens, recipients, NULL, count, NULL, NULL);
+}
+
+int message_relay_batch(dialog_t *dialog, int my_slot, const char *const *texts, const uint32_t *lens,
+                        const uint32_t *hops, int count) {
+    return publish_batch(dialog, my_slot, texts, lens, NULL, hops, count, NULL, NULL);
+}
+
+int message_send_stream(dialog_t *dialog, int my_slot, uint32_t stream_id, const char *data, uint64_t length,
+                        const slot_set_t *recipients, uint32_t window) {
+    if (length == 0 || stream_id == 0) return ERROR_MSG_SIZE;
+    uint32_t fragment = dialog->max_msg_size;
+    uint32_t words = recipients ? dialog->participant_words : 0;
+    uint32_t block = slab_block_size(fragment);
+    if (message_block_len(fragment, words) > block && block - words * 8 >= fragment / 2) {
+        fragment = block - words * 8;                            // leave room for the recipient bitmap in the same block
+    }
+    uint64_t count = (length + fragment - 1) / fragment;
 
-        if (all_read) {
-            m->message_exists = 0;                               // free this message slot for reuse
-            m->sender_slot = -1;
-            m->sender_pid = 0;
-            m->msg_text[0] = '\0';
-            for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-                m->has_been_read_by[s] = 0;                      // reset read-tracking state
+    if (window == 0) {                                           // a quarter of the ring and of the arena
+        uint32_t by_arena = dialog->slab.arena_size / 4 / slab_block_size(message_block_len(fragment, words));
+        window = dialog->ring_size / 4 < by_arena ? dialog->ring_size / 4 : by_arena;
+    }
+    if (window > MAX_STREAM_WINDOW) window = MAX_STREAM_WINDOW;
+    if (window == 0) window = 1;
+
+    // The fragments of the window are known by their sequence numbers: fragment i is out of the
+    // dialog once tail_seq has passed seqs[i % window], and they leave in the order they were sent.
+    uint64_t seqs[MAX_STREAM_WINDOW];
+    const char *texts[MAX_SEND_BATCH];
+    uint32_t lens[MAX_SEND_BATCH];
+    const slot_set_t *masks[MAX_SEND_BATCH];
+    uint64_t sent = 0, gone = 0;                                 // fragments published, and reclaimed since
+    uint64_t stuck_since = 0;                                    // when the stream stopped making progress
+    int refill = 0;                                              // the window was full and has not half drained yet
+    int yields = 0;
+
+    while (sent < count) {
+        uint32_t seen = atomic_load(&dialog->space_word);         // read before trying, so no wakeup is missed
+        uint64_t tail = atomic_load_explicit(&dialog->tail_seq, memory_order_acquire);
+        while (gone < sent && seqs[gone % window] < tail) gone++;
+        if (sent - gone == window) {                             // a reader whose cleanup lost the race does not notify us
+            cleanup_read_messages(dialog, my_slot, 0);
+            tail = atomic_load_explicit(&dialog->tail_seq, memory_order_acquire);
+            while (gone < sent && seqs[gone % window] < tail) gone++;
+        }
+
+        // Once the window is full we wait until half of it has drained, so the readers consume a run
+        // of fragments per wakeup of the sender instead of one.
+        uint64_t room = window - (sent - gone);
+        if (room == 0) refill = 1;
+        else if (room >= (window + 1) / 2) refill = 0;
+        if (room > 0 && !refill) {
+            uint64_t n = count - sent < room ? count - sent : room;
+            if (n > MAX_SEND_BATCH) n = MAX_SEND_BATCH;
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t off = (sent + i) * fragment;
+                texts[i] = data + off;
+                lens[i] = length - off < fragment ? (uint32_t)(length - off) : fragment;
+                masks[i] = recipients;
             }
+            stream_part_t part = { stream_id, sent * fragment, length };
+            uint64_t first = 0;
+            int took = publish_batch(dialog, my_slot, texts, lens, masks, NULL, (int)n, &part, &first);
+            if (took < 0) return ERROR_MSG_SIZE;
+            if (took > 0) {
+                for (uint64_t i = 0; i < (uint64_t)took; i++) seqs[(sent + i) % window] = first + i;
+                sent += (uint64_t)took;
+                dialog_notify(dialog);
+                stuck_since = 0;
+                yields = 0;
+                continue;
+            }
+        }
+        else if (refill && yields < STREAM_YIELDS) {
+            // The readers are busy with our fragments. Sleeping on space_word would make every one of
+            // them that reclaims a fragment wake us, so we only give up the CPU for a while.
+            yields++;
+            sched_yield();
+            continue;
         }
+
+        uint64_t now = monotonic_ns();
+        if (stuck_since == 0) stuck_since = now;
+        if (dialog->block_timeout_ms && now - stuck_since >= (uint64_t)dialog->block_timeout_ms * 1000000u) {
+            stat_add(&dialog_slot_stats(dialog)[my_slot].timed_out, count - sent);
+            return ERROR_LIMIT_REACHED;
+        }
+        dialog_wait_space(dialog, seen, SPACE_WAIT_SLICE_MS);    // the cleanup wakes us when it frees cells
     }
+    return 0;
 }
 
 int message_send(dialog_t *dialog, int my_slot, const char *text) {
-    int index = -1;
-    for (int i = 0; i < MAX_MSGS_PER_DIALOG; i++) {
-        if (dialog->messages[i].message_exists == 0) {           // first free message slot
-            index = i;
-            break;
+    return message_send_to(dialog, my_slot, text, NULL);
+}
+
+int message_send_to(dialog_t *dialog, int my_slot, const char *text, const slot_set_t *recipients) {
+    size_t len = strlen(text);
+    if (len == 0 || len > dialog->max_msg_size) return ERROR_MSG_SIZE;   // never truncate silently
+
+    uint32_t len32 = (uint32_t)len;
+    int sent = message_send_batch(dialog, my_slot, &text, &len32, &recipients, 1);
+    if (sent < 0) return ERROR_MSG_SIZE;
+    if (sent == 0) return ERROR_LIMIT_REACHED;                   // mailbox full, the caller decides how to report it
+    return 0;
+}
+
+void message_relay_control(dialog_t *dialog, int my_slot, uint32_t kind, uint32_t hops) {
+    if (kind == CONTROL_FLUSH) journal_sync(dialog);             // before the event, so it covers what was sent before it
+    lock_counted(&dialog->dialog_lock, &dialog->stats.lock);
+    post_control(dialog, kind, my_slot, hops);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+    dialog_notify(dialog);                                       // sleeping readers look at the control queue first
+}
+
+void message_control(dialog_t *dialog, int my_slot, uint32_t kind) {
+    message_relay_control(dialog, my_slot, kind, 0);
+}
+
+int control_next(dialog_t *dialog, int my_slot, control_event_t *out) {
+    _Atomic uint64_t *cursor_ptr = &dialog_cursors(dialog)[my_slot].control_seq;
+
+    while (1) {
+        uint64_t n = atomic_load_explicit(cursor_ptr, memory_order_relaxed);
+        uint64_t posted = atomic_load_explicit(&dialog->control_seq, memory_order_acquire);
+        if (n == posted) return 0;
+        if (posted - n > CONTROL_QUEUE_SIZE) n = posted - CONTROL_QUEUE_SIZE; // the older ones are overwritten
+
+        // Copy the event, then check that no poster reused its entry meanwhile, as for a ring cell.
+        const control_event_t *e = &dialog->control[n & (CONTROL_QUEUE_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        out->kind = e->kind;
+        out->slot = e->slot;
+        out->pid = e->pid;
+        out->hops = e->hops;
+        out->data_seq = e->data_seq;
+        atomic_thread_fence(memory_order_acquire);
+        int intact = seq == n + 1 && atomic_load_explicit(&e->seq, memory_order_relaxed) == seq;
+
+        atomic_store_explicit(cursor_ptr, n + 1, memory_order_relaxed);
+        if (intact) {
+            atomic_store_explicit(&out->seq, seq, memory_order_relaxed);
+            return 1;
         }
     }
-    if (index == -1) {
-        fprintf(stderr, "Dialog %d reached message limit.\n", dialog->dialog_id);
-        return ERROR_LIMIT_REACHED;                              // mailbox full
+}
+
+/*  Returns whether the message with these header fields is addressed to slot: a broadcast, or a
+    directed message with the bit of slot set in its recipient bitmap. Abandoned cells are for nobody.
+    The header may be torn, so the caller re-checks the cell before it trusts the answer.
+*/
+static int addressed_to(dialog_t *dialog, uint32_t off, uint32_t len, uint32_t words, int slot) {
+    if (words == 0) return 1;
+    if (words > dialog->participant_words || len > dialog->max_msg_size) return 0; // abandoned or torn
+    if (off > dialog->slab.arena_size - message_block_len(len, words)) return 0;
+    return message_recipients(dialog, off, len)[slot / 64] >> (slot % 64) & 1;
+}
+
+/*  Returns whether the dialog has a control event that the slot has not looked at yet.
+*/
+static int control_pending(dialog_t *dialog, int my_slot) {
+    return atomic_load_explicit(&dialog->control_seq, memory_order_acquire) !=
+           atomic_load_explicit(&dialog_cursors(dialog)[my_slot].control_seq, memory_order_relaxed);
+}
+
+static int pending_at(dialog_t *dialog, uint64_t cursor) {
+    if (atomic_load_explicit(&dialog->paused, memory_order_relaxed)) return 0; // nothing to take out until the resume
+    if (cursor < atomic_load_explicit(&dialog->tail_seq, memory_order_acquire)) return 1; // lapped: fetch will resync
+    message_t *m = &dialog_messages(dialog)[cursor & dialog->ring_mask];
+    return atomic_load_explicit(&m->seq, memory_order_acquire) == MSG_CELL_SEQ(cursor);
+}
+
+int message_pending(dialog_t *dialog, int my_slot) {
+    if (control_pending(dialog, my_slot)) return 1;
+    return pending_at(dialog, atomic_load_explicit(&dialog_cursors(dialog)[my_slot].read_seq, memory_order_relaxed));
+}
+
+int member_pending(const membership_t *member) {
+    if (!member->zero_copy) return message_pending(member->dialog, member->my_slot);
+    if (control_pending(member->dialog, member->my_slot)) return 1;
+    uint64_t cursor = atomic_load_explicit(&dialog_cursors(member->dialog)[member->my_slot].read_seq, memory_order_relaxed);
+    return pending_at(member->dialog, member->view_seq > cursor ? member->view_seq : cursor);
+}
+
+int message_fetch(dialog_t *dialog, int my_slot, received_message_t *out) {
+    _Atomic uint64_t *cursor_ptr = &dialog_cursors(dialog)[my_slot].read_seq;
+
+    while (1) {
+        uint64_t cursor = atomic_load_explicit(cursor_ptr, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&dialog->tail_seq, memory_order_acquire);
+        if (cursor < tail) {                                     // reclaimed before we got there: not for us, or dropped by the policy
+            atomic_store_explicit(cursor_ptr, tail, memory_order_release);
+            continue;
+        }
+
+        message_t *m = &dialog_messages(dialog)[cursor & dialog->ring_mask];
+        uint32_t seq = atomic_load_explicit(&m->seq, memory_order_acquire);
+        if (seq != MSG_CELL_SEQ(cursor)) return 0;               // next message not published yet
+
+        uint32_t off = m->payload_off;
+        uint32_t len = m->payload_len;
+        if (!addressed_to(dialog, off, len, m->recipient_words, my_slot)) { // skip it without copying the text
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&m->seq, memory_order_relaxed) == seq) {
+                atomic_store_explicit(cursor_ptr, cursor + 1, memory_order_release);
+            }
+            continue;
+        }
+        if (len > dialog->max_msg_size || off > dialog->slab.arena_size - len) continue; // torn header, the re-check below would fail too
+
+        out->seq = cursor;
+        out->sent_ns = m->sent_ns;
+        out->dialog_id = dialog->dialog_id;
+        out->sender_slot = m->sender_slot;
+        out->sender_pid = m->sender_pid;
+        out->length = len;
+        out->stream_id = m->stream_id;
+        out->stream_offset = m->stream_offset;
+        out->stream_length = m->stream_length;
+        memcpy(out->text, dialog_payloads(dialog) + off, len);
+        out->text[len] = '\0';
+
+        atomic_thread_fence(memory_order_acquire);               // copy must complete before re-checking the cell
+        if (atomic_load_explicit(&m->seq, memory_order_relaxed) != seq) continue; // reclaimed or overwritten while copying
+
+        atomic_store_explicit(cursor_ptr, cursor + 1, memory_order_release); // consumed: let reclamation move past it
+        stat_add(&dialog_slot_stats(dialog)[my_slot].received, 1);
+        stat_add(&dialog_slot_stats(dialog)[my_slot].received_bytes, len);
+        return 1;
     }
+}
 
-    message_t *m = &dialog->messages[index];
-    m->message_exists = 1;
-    m->dialog_id = dialog->dialog_id;
-    m->sender_slot = my_slot;
-    m->sender_pid = dialog->pids[my_slot];
+int message_peek(dialog_t *dialog, int my_slot, uint64_t *cursor, message_view_t *view) {
+    uint64_t read = atomic_load_explicit(&dialog_cursors(dialog)[my_slot].read_seq, memory_order_relaxed);
+    if (*cursor < read) *cursor = read;
 
-    strncpy(m->msg_text, text, MAX_MSG_SIZE - 1);                // bounded copy to avoid overflow
-    m->msg_text[MAX_MSG_SIZE - 1] = '\0';                        // ensure NUL-termination
+    while (1) {
+        uint64_t tail = atomic_load_explicit(&dialog->tail_seq, memory_order_acquire);
+        if (*cursor < tail) *cursor = tail;                      // reclaimed before we got there, as in message_fetch
+
+        message_t *m = &dialog_messages(dialog)[*cursor & dialog->ring_mask];
+        uint32_t seq = atomic_load_explicit(&m->seq, memory_order_acquire);
+        if (seq != MSG_CELL_SEQ(*cursor)) return 0;              // next message not published yet
+
+        uint64_t sent_ns = m->sent_ns;
+        uint32_t off = m->payload_off;
+        uint32_t len = m->payload_len;
+        int for_us = addressed_to(dialog, off, len, m->recipient_words, my_slot); // before the re-check: the block may be reused
+        int sender = m->sender_slot;
+        pid_t pid = m->sender_pid;
+        uint32_t stream_id = m->stream_id;
+        uint64_t stream_offset = m->stream_offset;
+        uint64_t stream_length = m->stream_length;
+        uint32_t hops = m->hops;
+        atomic_thread_fence(memory_order_acquire);               // the header must be read before re-checking the cell
+        if (atomic_load_explicit(&m->seq, memory_order_relaxed) != seq) continue;
+
+        if (!for_us || len > dialog->max_msg_size || off > dialog->slab.arena_size - len) {
+            (*cursor)++;                                         // not addressed to us (or abandoned)
+            continue;
+        }
 
-    for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-        m->has_been_read_by[s] = 0;                              // nobody has read it yet
+        view->seq = (*cursor)++;
+        view->sent_ns = sent_ns;
+        view->data = dialog_payloads(dialog) + off;              // stays put: our read cursor holds the cell
+        view->length = len;
+        view->sender_slot = sender;
+        view->sender_pid = pid;
+        view->stream_id = stream_id;
+        view->stream_offset = stream_offset;
+        view->stream_length = stream_length;
+        view->hops = hops;
+        return 1;
     }
+}
 
-    return 0;
+int message_release(dialog_t *dialog, int my_slot, const message_view_t *view) {
+    message_t *m = &dialog_messages(dialog)[view->seq & dialog->ring_mask];
+    int intact = atomic_load_explicit(&m->seq, memory_order_acquire) == MSG_CELL_SEQ(view->seq);
+
+    _Atomic uint64_t *cursor_ptr = &dialog_cursors(dialog)[my_slot].read_seq;
+    if (atomic_load_explicit(cursor_ptr, memory_order_relaxed) <= view->seq) {
+        atomic_store_explicit(cursor_ptr, view->seq + 1, memory_order_release); // we are its only writer
+    }
+    stat_add(&dialog_slot_stats(dialog)[my_slot].received, 1);
+    stat_add(&dialog_slot_stats(dialog)[my_slot].received_bytes, view->length);
+
+    cleanup_read_messages(dialog, my_slot, 0);
+    return intact ? 0 : -1;
 }
 
-int message_receive(dialog_t *dialog, int my_slot) {
-    int read_count = 0;
-    int saw_terminate = 0;
+/*  Writes the whole buffer to fd, retrying on partial writes and on signals.
+*/
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;                                              // nothing sensible to do if stdout is gone
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
 
-    for (int i = 0; i < MAX_MSGS_PER_DIALOG; i++) {
-        message_t *m = &dialog->messages[i];
-        if (!m->message_exists) continue;
-        if (m->has_been_read_by[my_slot]) continue;              // only consume unread messages for this slot
+/*  Writes a batch of output to stdout, timing the write if latency is not NULL.
+*/
+static void write_output(const char *buf, size_t len, latency_t *latency) {
+    uint64_t start = latency ? monotonic_ns() : 0;
+    write_all(STDOUT_FILENO, buf, len);
+    if (latency) hist_record(&latency->output, monotonic_ns() - start);
+}
 
-        printf("[dialog %d] (slot %d, pid %d): %s\n",
-               m->dialog_id, m->sender_slot, (int)m->sender_pid, m->msg_text);
-        fflush(stdout);                                          // avoid buffered output in multi-process runs
+int message_receive(dialog_t *dialog, int my_slot, latency_t *latency) {
+    if (atomic_load_explicit(&dialog->paused, memory_order_relaxed)) return 0;
 
-        m->has_been_read_by[my_slot] = 1;                        // mark as read for this participant
+    int read_count = 0;
+    _Atomic uint64_t *cursor_ptr = &dialog_cursors(dialog)[my_slot].read_seq;
+    uint64_t end = atomic_load_explicit(&dialog->terminate_seq, memory_order_acquire); // see dialog_terminated
+    received_message_t m;
+
+    // Messages are formatted into a buffer of this thread and written out with one write() per
+    // batch, instead of one printf + fflush per message. The buffer only needs to be flushed early
+    // if a very long backlog does not fit in it.
+    char out[OUTPUT_BATCH_SIZE];
+    size_t used = 0;
+
+    while ((end == 0 || atomic_load_explicit(cursor_ptr, memory_order_relaxed) < end - 1) &&
+           message_fetch(dialog, my_slot, &m)) {                 // drain everything published for this slot, in order
+        if (end != 0 && m.seq >= end - 1) break;                 // fetch passed over messages for others up to this one
+        if (latency) {
+            uint64_t now = monotonic_ns();
+            hist_record(&latency->queue, now > m.sent_ns ? now - m.sent_ns : 0);
+        }
         read_count++;
+        if (m.stream_id != 0 && m.stream_offset != 0) continue; // a stream is shown as one line, at its first fragment
 
-        if (strcmp(m->msg_text, "TERMINATE") == 0) saw_terminate = 1;
+        size_t body = m.stream_id != 0 ? MAX_LINE_OVERHEAD : m.length;
+        if (used + MAX_LINE_OVERHEAD + body > sizeof(out)) {
+            write_output(out, used, latency);
+            used = 0;
+        }
+        used += (size_t)snprintf(out + used, MAX_LINE_OVERHEAD, "[dialog %d] (slot %d, pid %d): ",
+                                 m.dialog_id, m.sender_slot, (int)m.sender_pid);
+        if (m.stream_id != 0) {                                  // its bytes are for programs (libdialog.h), not for the terminal
+            used += (size_t)snprintf(out + used, MAX_LINE_OVERHEAD, "<stream %u, %llu bytes>",
+                                     m.stream_id, (unsigned long long)m.stream_length);
+        }
+        else {
+            memcpy(out + used, m.text, m.length);
+            used += m.length;
+        }
+        out[used++] = '\n';
     }
 
-    cleanup_read_messages(dialog);                               // reclaim messages fully read by all active participants
+    cleanup_read_messages(dialog, my_slot, 0);                   // reclaim messages fully read by all active participants
+
+    int terminated = dialog_terminated(dialog, atomic_load_explicit(cursor_ptr, memory_order_relaxed));
+    if (terminated) {                                            // shown where the TERMINATE message used to be
+        if (used + MAX_LINE_OVERHEAD > sizeof(out)) {
+            write_output(out, used, latency);
+            used = 0;
+        }
+        used += (size_t)snprintf(out + used, MAX_LINE_OVERHEAD, "[dialog %d] (slot %d, pid %d): TERMINATE\n",
+                                 dialog->dialog_id, (int)dialog->terminate_slot, (int)dialog->terminate_pid);
+    }
 
-    return saw_terminate ? -1 : read_count;                      // -1 is used as a termination signal to the reader thread
+    if (used > 0) write_output(out, used, latency);              // one syscall for the whole batch
+
+    return terminated ? -1 : read_count;                         // -1 is used as a termination signal to the reader thread
+}
+
+/*  Reports a control event of a dialog followed by the reader thread on stderr. Terminating is shown
+    by message_receive, in order with the messages, and flushing needs nothing here: the reader writes
+    out what it received on every pass.
+*/
+static void report_control(const membership_t *member, const control_event_t *e) {
+    const char *what = e->kind == CONTROL_JOIN ? "joined" : e->kind == CONTROL_LEAVE ? "left" :
+                       e->kind == CONTROL_PAUSE ? "paused the dialog" :
+                       e->kind == CONTROL_RESUME ? "resumed the dialog" : NULL;
+    if (what) fprintf(stderr, "[dialog %d] slot %d (pid %d) %s\n", member->dialog_id, (int)e->slot, (int)e->pid, what);
 }
 
 void* reader_thread(void *arg) {
     thread_args_t *input = (thread_args_t*)arg;
+    membership_t *members = input->members;
+    int count = input->member_count;
+    int left = count;                                            // dialogs still followed
 
-    sem_wait(mutex);
-    message_receive(input->dialog, input->my_slot);              // print any messages that existed before this reader started
-    sem_post(mutex);
+    int spin_budget = 64;                                        // adapted by dialog_wait on every call
 
     while (1) {
-        sem_wait(&input->dialog->slot_sem[input->my_slot]);      // sleep until someone posts that this slot has new activity
-
-        sem_wait(mutex);                                         // protect shared memory while scanning/marking messages
-        int got = message_receive(input->dialog, input->my_slot);
-        sem_post(mutex);
+        // Drain every dialog that has something for us. The first round prints any messages that
+        // existed before this reader started.
+        for (int i = 0; i < count; i++) {
+            membership_t *m = &members[i];
+            if (!m->active) continue;
+
+            control_event_t e;
+            while (control_next(m->dialog, m->my_slot, &e)) report_control(m, &e); // control events go first
+
+            int got = message_receive(m->dialog, m->my_slot, m->latency); // lock-free: only our own cursor is written
+            if (got == -1) {
+                m->active = 0;                                   // terminated, and everything before it shown
+                left--;
+                lock_counted(&m->dialog->dialog_lock, &m->dialog->stats.lock);
+                stop_reading(m->dialog, m->my_slot);             // unread messages there no longer wait for us
+                pthread_mutex_unlock(&m->dialog->dialog_lock);
+            }
+        }
 
-        if (got == -1) {                                         // saw TERMINATE
+        if (left == 0) {
             *input->terminate_flag = 1;                          // tell writer thread to stop as well
+            char byte = 1;
+            if (write(input->wake_fd[1], &byte, 1) != 1) perror("write wake_fd"); // wake the writer out of poll()
             break;
         }
+
+        // Spin briefly, then sleep until a writer notifies. A single dialog keeps the plain futex wait.
+        if (count == 1) dialog_wait(members[0].dialog, members[0].my_slot, &spin_budget);
+        else dialog_wait_any(members, count, &spin_budget);
     }
 
     return NULL;
 }
 
-void* writer_thread(void *arg) {
-    thread_args_t *input = (thread_args_t*) arg;
-    char buf[MAX_MSG_SIZE];
+void latency_dump(const membership_t *members, int count) {
+    static histogram_t all_queue, all_output;                    // merged here; only one dump runs at a time
+    memset(&all_queue, 0, sizeof(all_queue));
+    memset(&all_output, 0, sizeof(all_output));
+
+    char label[64];
+    fprintf(stderr, "latency of pid %d:\n", (int)getpid());
+    for (int i = 0; i < count; i++) {
+        const membership_t *m = &members[i];
+        if (m->latency == NULL) continue;
+        snprintf(label, sizeof(label), "dialog %d slot %d queue", m->dialog_id, m->my_slot);
+        hist_print(stderr, label, &m->latency->queue);
+        snprintf(label, sizeof(label), "dialog %d slot %d output", m->dialog_id, m->my_slot);
+        hist_print(stderr, label, &m->latency->output);
+        hist_merge(&all_queue, &m->latency->queue);
+        hist_merge(&all_output, &m->latency->output);
+    }
+    if (count > 1) {
+        hist_print(stderr, "all dialogs queue", &all_queue);
+        hist_print(stderr, "all dialogs output", &all_output);
+    }
+}
+
+void* signal_thread(void *arg) {
+    thread_args_t *input = (thread_args_t*)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
 
     while (1) {
-        if (*input->terminate_flag) break;                        // termination requested by reader or self
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (*input->terminate_flag) break;                       // main asks us to stop
+        latency_dump(input->members, input->member_count);
+    }
+    return NULL;
+}
+
+/*  Publishes all the given lines, in order. When the dialog is full, the sender sleeps until the
+    cleanup frees cells and retries the lines that did not fit. Under the drop-oldest policy the
+    dialog never stays full; otherwise, if it stays full for longer than the block timeout of the
+    dialog, the remaining lines are dropped and reported. *full_since belongs to the caller and
+    remembers when the dialog was found full (0 if it is not), so while it stays full later batches
+    are dropped after a single attempt instead of waiting a whole timeout each.
+    It also returns early if termination is requested. The lines go to the dialog of member m.
+*/
+static void publish_lines(thread_args_t *input, membership_t *m, const char **texts, uint32_t *lens,
+                          const slot_set_t **recipients, int count, uint64_t *full_since) {
+    dialog_t *dialog = m->dialog;
+    int sent = 0;
+
+    while (sent < count) {
+        uint32_t seen = atomic_load(&dialog->space_word);         // read before trying, so no wakeup is missed
+        int n = message_send_batch(dialog, m->my_slot, texts + sent, lens + sent, recipients + sent, count - sent);
+        if (n < 0) {                                             // can never be published, waiting would not help
+            fprintf(stderr, "Dialog %d can not hold a message of %u bytes, dropped\n", m->dialog_id, lens[sent]);
+            sent++;
+            continue;
+        }
+        sent += n;
+        dialog_notify(dialog);                                   // one wakeup round per batch, not per line
+        if (n > 0) {
+            *full_since = 0;
+            continue;
+        }
 
-        /*  pollfd is used to perform a non-blocking check for user input on stdin.
+        if (*input->terminate_flag) return;
+        uint64_t now = monotonic_ns();
+        if (*full_since == 0) *full_since = now;
+        if (dialog->block_timeout_ms && now - *full_since >= (uint64_t)dialog->block_timeout_ms * 1000000u) {
+            stat_add(&dialog_slot_stats(dialog)[m->my_slot].timed_out, (uint64_t)(count - sent));
+            fprintf(stderr, "Dialog %d stayed full for %u ms, %d message(s) dropped\n",
+                    m->dialog_id, dialog->block_timeout_ms, count - sent);
+            return;
+        }
+        // Sleep in short slices: a reader whose cleanup lost the race for the reclaiming flag
+        // does not notify us, so we retry (and reclaim ourselves) now and then.
+        dialog_wait_space(dialog, seen, SPACE_WAIT_SLICE_MS);
+    }
+}
 
-            Instead of calling fgets() directly (which would block indefinitely),
-            poll() waits until either:
-            - input becomes available on STDIN, or
-            - the timeout expires.
+/*  Parses the recipient list at the start of a line, "@<slot>[,<slot>...] <text>", into a set.
+    It returns the length of the prefix (up to and including the space) if the line has one, 0 if it
+    is a line for everybody and -1 if it names a slot the dialog does not have.
+*/
+static int parse_recipients(const char *line, size_t len, uint32_t max_participants, slot_set_t *set) {
+    if (len < 3 || line[0] != '@' || line[1] < '0' || line[1] > '9') return 0; // "@home" is just text
 
-            This allows the thread to periodically wake up and check terminate_flag,
-            making termination responsive even if the user does not type anything.
-        */
+    slot_set_t bits = { { 0 } };
+    size_t i = 1;
+    while (1) {
+        uint32_t slot = 0;
+        size_t digits = 0;
+        for (; i < len && line[i] >= '0' && line[i] <= '9' && digits < 4; i++, digits++) {
+            slot = slot * 10 + (uint32_t)(line[i] - '0');
+        }
+        if (digits == 0 || i == len) return 0;
+        if (slot >= max_participants) return -1;
+        slot_set_add(&bits, (int)slot);
 
-        struct pollfd stdin_poll;
-        stdin_poll.fd = STDIN_FILENO;                             // monitor standard input
-        stdin_poll.events = POLLIN;                               // interested only in "data available for reading"
+        if (line[i] == ' ') break;
+        if (line[i] != ',') return 0;
+        i++;
+    }
+    *set = bits;
+    return (int)i + 1;
+}
 
-        /*  poll waits up to 200 ms for input to become available on stdin.
-            If no input arrives, it returns 0 and the loop continues.
-            This timeout-based approach prevents permanent blocking and
-            allows cooperative termination.
-        */
-        int poll_result = poll(&stdin_poll, 1, 200);
-        if (poll_result <= 0) continue;
+/*  Parses the dialog selector at the start of a line, "#<dialog_ID> <text>" or a line "#<dialog_ID>" alone,
+    of a process that follows several dialogs. It stores the member of that dialog in *target (NULL if
+    the process is not in it) and returns the length of the prefix, or 0 if the line has none.
+*/
+static int parse_target(const char *line, size_t len, membership_t *members, int count, membership_t **target) {
+    if (len < 2 || line[0] != '#' || line[1] < '0' || line[1] > '9') return 0; // "#tag" is just text
+
+    int id = 0;
+    size_t i = 1;
+    for (; i < len && line[i] >= '0' && line[i] <= '9' && i < 10; i++) id = id * 10 + (line[i] - '0');
+    if (i < len && line[i] != ' ') return 0;
+
+    *target = NULL;
+    for (int k = 0; k < count; k++) {
+        if (members[k].dialog_id == id) *target = &members[k];
+    }
+    return i < len ? (int)i + 1 : (int)i;
+}
 
-        if (fgets(buf, sizeof(buf), stdin) == NULL) break;       // EOF / input closed
-        trim_newline(buf);
+/*  Returns the control event that a line of input stands for: TERMINATE, FLUSH, PAUSE or RESUME alone
+    on the line. It returns 0 for every other line, which is sent as a message.
+*/
+static uint32_t parse_control(const char *line, size_t len) {
+    static const struct { const char *word; uint32_t kind; } commands[] = {
+        { "TERMINATE", CONTROL_TERMINATE }, { "FLUSH", CONTROL_FLUSH },
+        { "PAUSE", CONTROL_PAUSE }, { "RESUME", CONTROL_RESUME },
+    };
+    if (len < 5 || len > 9 || line[0] < 'A' || line[0] > 'Z') return 0; // the common case costs one comparison
+    for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); k++) {
+        if (strlen(commands[k].word) == len && memcmp(line, commands[k].word, len) == 0) return commands[k].kind;
+    }
+    return 0;
+}
 
-        if (buf[0] == '\0') continue;                            // ignore empty messages
+/*  Returns 1 once the writer has nothing left to send to: every dialog is terminated, or no longer followed.
+*/
+static int all_terminated(const membership_t *members, int count) {
+    for (int k = 0; k < count; k++) {
+        if (members[k].active && atomic_load(&members[k].dialog->terminate_seq) == 0) return 0;
+    }
+    return 1;
+}
 
-        sem_wait(mutex);
+void* writer_thread(void *arg) {
+    thread_args_t *input = (thread_args_t*) arg;
 
-        int send_status = message_send(input->dialog, input->my_slot, buf);
+    /*  Input is read with read() in blocks of up to INPUT_BLOCK_SIZE bytes and split into lines here,
+        instead of one fgets() per line. Typed input simply arrives one line per read(), while a
+        file or a pipe (./dialog 5 < log) is consumed a whole block at a time, and all the lines of a
+        block are published with one reservation in the ring and one wakeup of the readers.
+    */
+    char block[INPUT_BLOCK_SIZE];
+    size_t have = 0;
+    const char *texts[MAX_SEND_BATCH];
+    uint32_t lens[MAX_SEND_BATCH];
+    const slot_set_t *recipients[MAX_SEND_BATCH];                // NULL for a line to everybody, else &sets[i]
+    slot_set_t sets[MAX_SEND_BATCH];
+    uint64_t full_since[MAX_JOINED_DIALOGS] = { 0 };             // see publish_lines, one per dialog
+    membership_t *members = input->members;
+    membership_t *current = &members[0];                         // where lines without "#<dialog_ID>" go
+    int done = 0;
+
+    while (!done) {
+        if (*input->terminate_flag) break;                        // termination requested by reader or self
 
-        if (send_status == 0) {
-            for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-                if (input->dialog->slot_used[s]) {
-                    sem_post(&input->dialog->slot_sem[s]);           // wake all active participants to check for new messages
+        /*  poll waits, without a timeout, until either:
+            - input becomes available on STDIN, or
+            - the reader thread writes to wake_fd because every dialog was terminated.
+
+            Termination is therefore event-driven: the writer never wakes up
+            just to check terminate_flag, and it reacts to it immediately.
+        */
+        struct pollfd fds[2];
+        fds[0].fd = STDIN_FILENO;                                 // monitor standard input
+        fds[0].events = POLLIN;
+        fds[1].fd = input->wake_fd[0];                            // and the wakeup pipe of the reader
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;                                // every dialog was terminated
+
+        ssize_t n = read(STDIN_FILENO, block + have, sizeof(block) - have);
+        if (n < 0 && errno == EINTR) continue;
+        int eof = (n <= 0);                                       // EOF / input closed
+        if (!eof) have += (size_t)n;
+
+        // Split the block into lines. A line longer than the message size of the dialog is sent in pieces, and
+        // at EOF (or when the whole block is one line without a newline) the incomplete rest counts as a line.
+        // A batch holds lines for one dialog only; a line for another one publishes the batch first.
+        int count = 0;
+        membership_t *batch = current;
+        size_t start = 0;
+        while (start < have) {
+            char *nl = memchr(block + start, '\n', have - start);
+            size_t end = nl ? (size_t)(nl - block) : have;
+            if (!nl && !eof && (start > 0 || have < sizeof(block))) break; // wait for the rest of this line
+            size_t next = nl ? end + 1 : end;                     // empty lines are ignored
+
+            // "#7 text" sends text to dialog 7, and a line "#7" alone switches to it (several dialogs only).
+            membership_t *target = current;
+            int select = 0;
+            if (input->member_count > 1) {
+                select = parse_target(block + start, end - start, members, input->member_count, &target);
+                if (select > 0 && target == NULL) {
+                    fprintf(stderr, "This process is not in that dialog, line not sent\n");
+                    start = next;
+                    continue;
+                }
+                if (select > 0 && start + (size_t)select == end) {
+                    current = target;
+                    start = next;
+                    continue;
                 }
             }
-        }
-        else {
-            fprintf(stderr, "Dialog is full. No more messages can be sent.\n");
-            exit(ERROR_LIMIT_REACHED);
-        }
+            const char *text = block + start + select;
+            size_t text_len = end - start - (size_t)select;
+
+            // TERMINATE, FLUSH, PAUSE and RESUME are control events, posted once the lines before them are sent.
+            uint32_t control = parse_control(text, text_len);
+            if (control != 0) {
+                if (count > 0) publish_lines(input, batch, texts, lens, recipients, count, &full_since[batch - members]);
+                count = 0;
+                message_control(target->dialog, target->my_slot, control);
+                start = next;
+                if (control == CONTROL_TERMINATE && all_terminated(members, input->member_count)) {
+                    done = 1;
+                    break;
+                }
+                continue;
+            }
 
-        sem_post(mutex);
+            // "@2,5 text" sends text to slots 2 and 5 only; every other line goes to the whole dialog.
+            slot_set_t to;
+            int prefix = parse_recipients(text, text_len, target->dialog->max_participants, &to);
+            if (prefix < 0) {
+                fprintf(stderr, "Dialog %d has slots 0 to %u only, line not sent\n",
+                        target->dialog_id, target->dialog->max_participants - 1);
+                prefix = (int)text_len;                           // drop the whole line
+            }
 
-        if (strncmp(buf, "TERMINATE", 9) == 0) {
-            *input->terminate_flag = 1;                              // stop this writer; reader will also exit when it sees it
-            break;
+            if (target != batch && count > 0) {
+                publish_lines(input, batch, texts, lens, recipients, count, &full_since[batch - members]);
+                count = 0;
+            }
+            batch = target;
+
+            size_t max_len = target->dialog->max_msg_size;         // chosen when the segment was created
+            for (size_t piece = (size_t)prefix; piece < text_len; piece += max_len) {
+                size_t len = text_len - piece < max_len ? text_len - piece : max_len;
+                if (count == MAX_SEND_BATCH) {
+                    publish_lines(input, batch, texts, lens, recipients, count, &full_since[batch - members]);
+                    count = 0;
+                }
+                texts[count] = text + piece;
+                lens[count] = (uint32_t)len;
+                recipients[count] = NULL;
+                if (prefix > 0) {
+                    sets[count] = to;
+                    recipients[count] = &sets[count];
+                }
+                count++;
+            }
+            start = next;
         }
+
+        if (count > 0) publish_lines(input, batch, texts, lens, recipients, count, &full_since[batch - members]);
+        memmove(block, block + start, have - start);              // keep the incomplete line for the next read
+        have -= start;
+
+        if (eof) break;
     }
 
     return NULL;
-}
\ No newline at end of file
+}
@@ -1,8 +1,16 @@
 /* utils.c */
 
+#define _GNU_SOURCE
+
+#include "../include/journal.h"
 #include "../include/utils.h"
 
-sem_t *mutex = NULL;
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+pthread_mutex_t *mutex = NULL;
 
 /*  Error Messages that might help in debugging.
     These errors are implementation specific so they should not be placed in
@@ -12,130 +20,602 @@ sem_t *mutex = NULL;
 #define ERROR_EMPTY_ARG 2
 #define ERROR_NOT_INT 3
 #define ERROR_NOT_IN_RANGE 4
-#define ERROR_LIMIT_REACHED 5
+#define ERROR_LIMIT_REACHED 5                                    // reported by the callers of join_dialog
+
+#define ERROR_BAD_CONFIG 7
+#define ERROR_BAD_LAYOUT 8
 
-int check_argument_validity(int argc, char* argv[]) {
-    if (argc != 2) {                                             // require exactly one argument: the dialog ID
-        fprintf(stderr, "Usage: ./dialog <dialog_ID>\n");
+#define LAYOUT_ALIGN 64                                          // regions start on their own cache line
+
+int check_argument_validity(int argc, char* argv[], int *ids) {
+    if (argc < 2 || argc - 1 > MAX_JOINED_DIALOGS) {             // one or more dialog IDs
+        fprintf(stderr, "Usage: ./dialog <dialog_ID> [<dialog_ID> ...] (at most %d)\n", MAX_JOINED_DIALOGS);
         exit(ERROR_ARGS_NO);
     }
-    if (argv[1][0] == '\0') {                                    // reject empty string early
-        fprintf(stderr, "Error: Empty <dialog_ID>.\n");
-        exit(ERROR_NOT_INT);
-    }
-    size_t n = strlen(argv[1]);
-    for (size_t i = 0; i < n; i++) {
-        if (argv[1][i] < '0' || argv[1][i] > '9') {              // enforce numeric-only input (no signs, no spaces)
-            fprintf(stderr, "Error: <dialog_ID> must be an integer in [0,%d]\n", MAX_DIALOGS - 1);
+    for (int a = 1; a < argc; a++) {
+        if (argv[a][0] == '\0') {                                // reject empty string early
+            fprintf(stderr, "Error: Empty <dialog_ID>.\n");
             exit(ERROR_NOT_INT);
         }
+        size_t n = strlen(argv[a]);
+        if (n > 9) {                                             // more dialogs than MAX_DIALOGS_LIMIT anyway, and atoi would overflow
+            fprintf(stderr, "Error: <dialog_ID> must be below %d\n", MAX_DIALOGS_LIMIT);
+            exit(ERROR_NOT_IN_RANGE);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (argv[a][i] < '0' || argv[a][i] > '9') {          // enforce numeric-only input (no signs, no spaces)
+                fprintf(stderr, "Error: <dialog_ID> must be a non-negative integer\n");
+                exit(ERROR_NOT_INT);
+            }
+        }
+        ids[a - 1] = atoi(argv[a]);                              // safe after digit-only validation; the range is checked by check_layout
+        for (int b = 0; b < a - 1; b++) {
+            if (ids[b] == ids[a - 1]) {                          // one slot per dialog and process
+                fprintf(stderr, "Error: dialog %d is given twice\n", ids[b]);
+                exit(ERROR_ARGS_NO);
+            }
+        }
     }
-    int dialog_id = atoi(argv[1]);                               // safe after digit-only validation
-    if (dialog_id < 0 || dialog_id >= MAX_DIALOGS) {             // keep ID within array bounds
-        fprintf(stderr, "Error: <dialog_ID> must be in [0,%d]\n", MAX_DIALOGS - 1);
-        exit(ERROR_NOT_IN_RANGE);
+    return argc - 1;
+}
+
+/*  Reads the environment variable name as an unsigned number (decimal, or hex with 0x).
+    It returns def if the variable is not set. A value that is not in [min, max] is reported, sets
+    *bad and gives def as well, so that the caller can report every bad variable before it fails.
+*/
+static uint64_t env_value(const char *name, uint64_t def, uint64_t min, uint64_t max, int *bad) {
+    const char *s = getenv(name);
+    if (s == NULL || *s == '\0') return def;
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 0);
+    if (*end != '\0' || errno != 0 || s[0] == '-' || v < min || v > max) {
+        fprintf(stderr, "Error: %s must be a number in [%llu,%llu]\n", name,
+                (unsigned long long)min, (unsigned long long)max);
+        *bad = 1;
+        return def;
     }
-    return dialog_id;
+    return v;
 }
 
-shared_memory_t* create_and_attach_shared_mem(int *out_shm_id) {
-    key_t mem_key = 612004;                                      // (my bday) - fixed key so all processes attach to the same segment
+int try_load_config(dialog_config_t *cfg) {
+    int bad = 0;
+    cfg->shm_key = (key_t)env_value("DIALOG_SHM_KEY", DEFAULT_SHM_KEY, 1, INT32_MAX, &bad);
+    cfg->max_dialogs = (uint32_t)env_value("DIALOG_MAX_DIALOGS", DEFAULT_MAX_DIALOGS, 1, MAX_DIALOGS_LIMIT, &bad);
+    cfg->max_participants = (uint32_t)env_value("DIALOG_MAX_PARTICIPANTS", DEFAULT_PARTICIPANTS, 1, MAX_DIALOG_PARTICIPANTS, &bad);
+    cfg->ring_size = (uint32_t)env_value("DIALOG_RING_SIZE", DEFAULT_RING_SIZE, 2, MAX_RING_SIZE, &bad);
+    cfg->max_msg_size = (uint32_t)env_value("DIALOG_MAX_MSG_SIZE", MAX_MSG_SIZE, 1, MAX_MSG_SIZE, &bad);
+    uint32_t largest = message_block_len(cfg->max_msg_size, participant_words(cfg->max_participants));
+    cfg->arena_size = (uint32_t)env_value("DIALOG_ARENA_SIZE", DEFAULT_ARENA_SIZE,
+                                          slab_block_size(largest), MAX_ARENA_SIZE, &bad); // room for at least one directed message
 
-    int shm_id = shmget(mem_key, sizeof(shared_memory_t), IPC_CREAT | 0666);
-    if (shm_id == -1) {
-        perror("shmget");
-        exit(errno);
+    if (cfg->ring_size & (cfg->ring_size - 1)) {                 // the ring maps sequence numbers with a mask
+        fprintf(stderr, "Error: DIALOG_RING_SIZE must be a power of two\n");
+        bad = 1;
     }
 
-    void *p = shmat(shm_id, NULL, 0);
-    if (p == (void*)-1) {
-        perror("shmat");
-        exit(errno);
+    const char *policy = getenv("DIALOG_BACKPRESSURE");
+    if (policy == NULL || *policy == '\0' || strcmp(policy, "block") == 0) cfg->backpressure = BACKPRESSURE_BLOCK;
+    else if (strcmp(policy, "drop-oldest") == 0) cfg->backpressure = BACKPRESSURE_DROP_OLDEST;
+    else if (strcmp(policy, "skip-lagging") == 0) cfg->backpressure = BACKPRESSURE_SKIP_LAGGING;
+    else {
+        fprintf(stderr, "Error: DIALOG_BACKPRESSURE must be block, drop-oldest or skip-lagging\n");
+        bad = 1;
     }
+    cfg->block_timeout_ms = (uint32_t)env_value("DIALOG_BLOCK_TIMEOUT_MS", 0, 0, 24u * 3600 * 1000, &bad); // 0: wait forever
+    cfg->lag_limit = (uint32_t)env_value("DIALOG_LAG_LIMIT", 0, 0, MAX_RING_SIZE, &bad);                 // 0: three quarters of the ring
 
-    if (out_shm_id) *out_shm_id = shm_id;                        // return shm id to caller for later cleanup
-    return (shared_memory_t*)p;
+    cfg->journal_dir = getenv("DIALOG_JOURNAL_DIR");            // journaling is off unless a directory is given
+    if (cfg->journal_dir && *cfg->journal_dir == '\0') cfg->journal_dir = NULL;
+    cfg->journal_size = env_value("DIALOG_JOURNAL_SIZE", DEFAULT_JOURNAL_SIZE, 4096, (uint64_t)1 << 40, &bad);
+    cfg->journal_sync_ms = (uint32_t)env_value("DIALOG_JOURNAL_SYNC_MS", DEFAULT_JOURNAL_SYNC_MS, 1, 3600 * 1000, &bad);
+    cfg->replay = getenv("DIALOG_REPLAY_FROM") != NULL;
+    cfg->replay_from = env_value("DIALOG_REPLAY_FROM", 0, 0, UINT64_MAX, &bad);
+    cfg->latency_at_exit = (int)env_value("DIALOG_LATENCY_AT_EXIT", 0, 0, 1, &bad);
+    cfg->stream_window = (uint32_t)env_value("DIALOG_STREAM_WINDOW", 0, 0, MAX_STREAM_WINDOW, &bad); // 0: see message_send_stream
+
+    if (bad) {
+        errno = EINVAL;
+        return ERROR_BAD_CONFIG;
+    }
+    return 0;
 }
 
-void init_shared_memory(shared_memory_t *shared_mem) {
-    shared_mem->total_processes = 0;                             // reset global process counter
+void load_config(dialog_config_t *cfg) {
+    int rc = try_load_config(cfg);
+    if (rc != 0) exit(rc);
+}
 
-    for (int i = 0; i < MAX_DIALOGS; i++) {
-        dialog_t *dialog = &shared_mem->dialogs[i];
-        dialog->is_active = 0;
-        dialog->dialog_id = i;                                   // stable ID equals index
-        dialog->dialog_participants = 0;
+static uint64_t align_up(uint64_t n) {
+    return (n + LAYOUT_ALIGN - 1) & ~(uint64_t)(LAYOUT_ALIGN - 1);
+}
 
-        for (int j = 0; j < MAX_DIALOG_PARTICIPANTS; j++) {
-            dialog->slot_used[j] = 0;                            // all participant slots start free
-            dialog->pids[j] = 0;
-        }
+/*  Layout of one dialog region: the dialog_t, then the cursors and the counters of its slots, then
+    the message ring, then the payload arena and the journal staging area. All offsets are relative
+    to the start of the region.
+*/
+static uint64_t cursors_offset(void) {
+    return align_up(sizeof(dialog_t));
+}
+
+static uint64_t slot_stats_offset(uint32_t participants) {
+    return align_up(cursors_offset() + (uint64_t)participants * sizeof(slot_cursor_t));
+}
+
+static uint64_t ring_offset(uint32_t participants) {
+    return align_up(slot_stats_offset(participants) + (uint64_t)participants * sizeof(slot_stats_t));
+}
+
+static uint64_t arena_offset(uint32_t participants, uint32_t ring_size) {
+    return align_up(ring_offset(participants) + (uint64_t)ring_size * sizeof(message_t));
+}
+
+static uint64_t staging_offset(uint32_t participants, uint32_t ring_size, uint32_t arena_size) {
+    return align_up(arena_offset(participants, ring_size) + arena_size);
+}
+
+/*  The journal staging area holds a record of the longest message: its text fits in the arena, and
+    the record header and the padding in LAYOUT_ALIGN more bytes.
+*/
+static uint32_t staging_size(uint32_t arena_size) {
+    return arena_size + LAYOUT_ALIGN;
+}
 
-        dialog->sem_initialized = 1;                             // mark semaphores as usable for cleanup logic
-        for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-            if (sem_init(&dialog->slot_sem[s], 1, 0) != 0) {     // pshared=1 => usable across processes, initial value 0
-                perror("sem_init");
-                exit(errno);
+static uint64_t dialog_stride(const dialog_config_t *cfg) {
+    return align_up(staging_offset(cfg->max_participants, cfg->ring_size, cfg->arena_size) + staging_size(cfg->arena_size));
+}
+
+static uint64_t segment_size(const dialog_config_t *cfg) {
+    return align_up(sizeof(shared_memory_t)) + cfg->max_dialogs * dialog_stride(cfg);
+}
+
+int process_dead(pid_t pid) {
+    return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/*  Initializes an inter-process lock: process-shared, so it works from every attached process, and
+    robust, so the kernel hands it over when its owner dies instead of keeping it locked forever.
+*/
+static void init_lock(pthread_mutex_t *lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_mutex_init");
+        exit(rc);
+    }
+}
+
+/*  Makes sure the global mutex of the segment is initialized and points mutex to it. The global
+    mutex can not protect its own initialization, so the first process claims mutex_state with a
+    compare-and-swap and the others wait until it is MUTEX_READY, which takes microseconds. If the
+    claiming process died meanwhile, its claim is dropped and the initialization starts over.
+*/
+static void open_global_mutex(shared_memory_t *shared_mem) {
+    pid_t me = getpid();
+    while (1) {
+        uint32_t state = atomic_load(&shared_mem->mutex_state);
+        if (state == MUTEX_READY) break;
+        if (state == 0) {
+            if (atomic_compare_exchange_strong(&shared_mem->mutex_state, &state, (uint32_t)me)) {
+                init_lock(&shared_mem->mutex);
+                atomic_store(&shared_mem->mutex_state, MUTEX_READY);
+                break;
             }
+            continue;
         }
+        if (process_dead((pid_t)state)) atomic_compare_exchange_strong(&shared_mem->mutex_state, &state, 0);
+        else sched_yield();
+    }
+    mutex = &shared_mem->mutex;
+}
 
-        for (int k = 0; k < MAX_MSGS_PER_DIALOG; k++) {
-            message_t *msg = &dialog->messages[k];
-            msg->message_exists = 0;                             // mailbox starts empty
-            msg->dialog_id = i;
-            msg->sender_slot = -1;
-            msg->sender_pid = 0;
-            msg->msg_text[0] = '\0';
-            for (int p = 0; p < MAX_DIALOG_PARTICIPANTS; p++) {
-                msg->has_been_read_by[p] = 0;                    // no reads registered
-            }
+int try_attach_and_lock_shared_mem(const dialog_config_t *cfg, shared_memory_t **out, int *out_shm_id) {
+    while (1) {
+        // The segment is sized for our config only if we are the ones creating it. If it already
+        // exists we attach it whole, with the capacities it was created with.
+        int shm_id = shmget(cfg->shm_key, (size_t)segment_size(cfg), IPC_CREAT | IPC_EXCL | 0666);
+        if (shm_id == -1 && errno == EEXIST) {
+            shm_id = shmget(cfg->shm_key, 0, 0666);
         }
+        if (shm_id == -1) {
+            perror("shmget");
+            return errno;
+        }
+
+        shared_memory_t *shared_mem = shmat(shm_id, NULL, 0);
+        if (shared_mem == (void*)-1) {
+            perror("shmat");
+            return errno;
+        }
+
+        // The mutex of a segment from another build may be anywhere, so its header is checked first.
+        // A magic of 0 means that nobody has initialized the segment yet.
+        if (shared_mem->magic != 0 && (shared_mem->magic != DIALOG_SHM_MAGIC || shared_mem->version != DIALOG_SHM_VERSION)) {
+            fprintf(stderr, "Error: the shared memory segment was created by an incompatible version "
+                            "(remove it with ipcrm, or pick another DIALOG_SHM_KEY)\n");
+            shmdt(shared_mem);
+            errno = EPROTO;
+            return ERROR_BAD_LAYOUT;
+        }
+
+        open_global_mutex(shared_mem);
+        lock_counted(mutex, &shared_mem->mutex_stats);
+        if (!shared_mem->removed) {
+            if (out_shm_id) *out_shm_id = shm_id;                // return shm id to caller for later cleanup
+            *out = shared_mem;
+            return 0;
+        }
+
+        // The last process removed this segment after we attached it. Make sure it is really gone
+        // (that process may have died half-way) and start over with a new one.
+        shmctl(shm_id, IPC_RMID, NULL);
+        pthread_mutex_unlock(mutex);
+        shmdt(shared_mem);
     }
+}
+
+shared_memory_t* attach_and_lock_shared_mem(const dialog_config_t *cfg, int *out_shm_id) {
+    shared_memory_t *shared_mem = NULL;
+    int rc = try_attach_and_lock_shared_mem(cfg, &shared_mem, out_shm_id);
+    if (rc != 0) exit(rc);
+    return shared_mem;
+}
+
+/*  Writes the header of a new segment with the capacities of cfg and marks it as initialized.
+*/
+static void write_header(shared_memory_t *shared_mem, const dialog_config_t *cfg) {
+    shared_mem->magic = DIALOG_SHM_MAGIC;
+    shared_mem->version = DIALOG_SHM_VERSION;
+    shared_mem->segment_size = segment_size(cfg);
+    shared_mem->shm_key = cfg->shm_key;
+    shared_mem->max_dialogs = cfg->max_dialogs;
+    shared_mem->max_participants = cfg->max_participants;
+    shared_mem->ring_size = cfg->ring_size;
+    shared_mem->max_msg_size = cfg->max_msg_size;
+    shared_mem->arena_size = cfg->arena_size;
+    shared_mem->dialogs_offset = align_up(sizeof(shared_memory_t));
+    shared_mem->dialog_stride = dialog_stride(cfg);
+    shared_mem->removed = 0;
+    shared_mem->total_processes = 0;                             // reset global process counter
+
+    // The dialogs are left alone: a new segment is all zeroes, which is what a dialog nobody has
+    // joined yet looks like. prepare_dialog fills in the rest on the first join.
 
     shared_mem->is_initialized = 1;                              // publish "ready" state last
 }
 
-int join_dialog(dialog_t *dialog, pid_t pid) {
-    for (int i = 0; i < MAX_DIALOG_PARTICIPANTS; i++) {
-        if (dialog->slot_used[i] == 0) {                         // pick first free slot
-            dialog->slot_used[i] = 1;
-            dialog->pids[i] = pid;
-            dialog->dialog_participants++;
-            return i;                                            // caller stores this slot as its identity in the dialog
+int try_init_shared_memory(shared_memory_t *shared_mem, const dialog_config_t *cfg, int shm_id) {
+    struct shmid_ds info;
+    if (shmctl(shm_id, IPC_STAT, &info) != 0) {
+        int rc = errno;
+        perror("shmctl");
+        pthread_mutex_unlock(mutex);
+        shmdt(shared_mem);
+        errno = rc;
+        return rc;
+    }
+    if ((uint64_t)info.shm_segsz < segment_size(cfg)) {         // created by a process with smaller capacities
+        fprintf(stderr, "Error: the shared memory segment has %zu bytes, this configuration needs %llu\n",
+                (size_t)info.shm_segsz, (unsigned long long)segment_size(cfg));
+        pthread_mutex_unlock(mutex);
+        shmdt(shared_mem);
+        errno = EPROTO;
+        return ERROR_BAD_LAYOUT;
+    }
+
+    write_header(shared_mem, cfg);
+    return 0;
+}
+
+void init_shared_memory(shared_memory_t *shared_mem, const dialog_config_t *cfg, int shm_id) {
+    int rc = try_init_shared_memory(shared_mem, cfg, shm_id);
+    if (rc != 0) exit(rc);
+}
+
+shared_memory_t* create_private_segment(const dialog_config_t *cfg) {
+    void *memory = mmap(NULL, (size_t)segment_size(cfg), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(errno);
+    }
+    shared_memory_t *shared_mem = memory;                        // all zeroes, like a new System V segment
+    open_global_mutex(shared_mem);
+    write_header(shared_mem, cfg);
+    return shared_mem;
+}
+
+/*  Writes the fields of a dialog that do not start as 0, with the capacities of the segment header.
+*/
+static void init_dialog(shared_memory_t *shared_mem, dialog_t *dialog, int dialog_id) {
+    dialog->dialog_id = dialog_id;                               // stable ID equals index
+    dialog->segment_offset = (uint64_t)((char*)dialog - (char*)shared_mem);
+
+    dialog->max_participants = shared_mem->max_participants;     // every dialog carries its own capacities
+    dialog->participant_words = participant_words(shared_mem->max_participants);
+    dialog->max_msg_size = shared_mem->max_msg_size;
+    dialog->ring_size = shared_mem->ring_size;
+    dialog->ring_mask = shared_mem->ring_size - 1;
+    dialog->cursors_offset = cursors_offset();
+    dialog->slot_stats_offset = slot_stats_offset(shared_mem->max_participants);
+    dialog->ring_offset = ring_offset(shared_mem->max_participants);
+    dialog->arena_offset = arena_offset(shared_mem->max_participants, shared_mem->ring_size);
+    dialog->staging_offset = staging_offset(shared_mem->max_participants, shared_mem->ring_size, shared_mem->arena_size);
+    dialog->staging_size = staging_size(shared_mem->arena_size);
+    dialog->backpressure = BACKPRESSURE_BLOCK;                   // replaced by activate_dialog
+    dialog->lag_limit = shared_mem->ring_size - shared_mem->ring_size / 4;
+    dialog->slab.arena_size = shared_mem->arena_size;
+
+    init_lock(&dialog->dialog_lock);                             // a free, robust inter-process lock
+}
+
+dialog_t* prepare_dialog(shared_memory_t *shared_mem, int dialog_id) {
+    dialog_t *dialog = dialog_at(shared_mem, dialog_id);
+    pid_t me = getpid();
+    while (1) {
+        uint32_t state = atomic_load(&dialog->init_state);
+        if (state == DIALOG_READY) return dialog;
+        if (state == 0) {
+            if (atomic_compare_exchange_strong(&dialog->init_state, &state, (uint32_t)me)) {
+                init_dialog(shared_mem, dialog, dialog_id);
+                atomic_fetch_or(&shared_mem->ready_dialogs[dialog_id / 64], (uint64_t)1 << (dialog_id % 64));
+                atomic_store(&dialog->init_state, DIALOG_READY);
+                return dialog;
+            }
+            continue;
         }
+        if (process_dead((pid_t)state)) atomic_compare_exchange_strong(&dialog->init_state, &state, 0);
+        else sched_yield();
+    }
+}
+
+int try_check_layout(shared_memory_t *shared_mem, int shm_id, int dialog_id) {
+    if (shared_mem->magic != DIALOG_SHM_MAGIC || shared_mem->version != DIALOG_SHM_VERSION) {
+        fprintf(stderr, "Error: the shared memory segment was created by an incompatible version "
+                        "(remove it with ipcrm, or pick another DIALOG_SHM_KEY)\n");
+        pthread_mutex_unlock(mutex);                             // not our layout: leave the segment alone
+        shmdt(shared_mem);
+        errno = EPROTO;
+        return ERROR_BAD_LAYOUT;
+    }
+    if (dialog_id >= (int)shared_mem->max_dialogs) {             // keep ID within the dialogs of the segment
+        fprintf(stderr, "Error: <dialog_ID> must be in [0,%u]\n", shared_mem->max_dialogs - 1);
+        detach_shared_memory(shared_mem, shm_id);               // removes the segment if nobody uses it yet
+        errno = EINVAL;
+        return ERROR_NOT_IN_RANGE;
+    }
+    return 0;
+}
+
+void check_layout(shared_memory_t *shared_mem, int shm_id, int dialog_id) {
+    int rc = try_check_layout(shared_mem, shm_id, dialog_id);
+    if (rc != 0) exit(rc);
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void lock_counted(pthread_mutex_t *lock, lock_stats_t *stats) {
+    int rc = pthread_mutex_trylock(lock);                        // fast path: the lock was free
+    if (rc == EBUSY) {
+        uint64_t start = monotonic_ns();
+        rc = pthread_mutex_lock(lock);
+        stat_add(&stats->wait_ns, monotonic_ns() - start);       // we hold the lock, so we are the only writer
+        stat_add(&stats->contended, 1);
+    }
+    if (rc == EOWNERDEAD) {                                      // its owner died holding it: take it over
+        pthread_mutex_consistent(lock);
+        stat_add(&stats->recovered, 1);
+    }
+    else if (rc != 0) {
+        errno = rc;
+        perror("pthread_mutex_lock");
+        exit(rc);
+    }
+    stat_add(&stats->acquired, 1);
+}
+
+void unregister_process(shared_memory_t *shared_mem) {
+    int n = atomic_load(&shared_mem->total_processes);
+    while (n > 0 && !atomic_compare_exchange_weak(&shared_mem->total_processes, &n, n - 1)) { }
+}
+
+void activate_dialog(dialog_t *dialog, int dialog_id, const dialog_config_t *cfg) {
+    if (dialog->is_active) return;                               // the first participant chose the policy already
+
+    dialog->dialog_id = dialog_id;
+    dialog->backpressure = cfg->backpressure;
+    dialog->block_timeout_ms = cfg->block_timeout_ms;
+    dialog->lag_limit = cfg->lag_limit ? cfg->lag_limit : dialog->ring_size - dialog->ring_size / 4;
+    if (cfg->journal_dir) {
+        journal_create(dialog, cfg->shm_key, cfg->journal_dir, cfg->journal_size, cfg->journal_sync_ms);
+    }
+    atomic_store(&dialog->terminate_seq, 0);                     // a terminated dialog ends once it is empty
+    atomic_store(&dialog->paused, 0);
+    dialog->is_active = 1;
+}
+
+int join_dialog(dialog_t *dialog, pid_t pid, int mode) {
+    reap_dead_participants(dialog);                              // their slots may be the ones we need
+
+    for (uint32_t w = 0; w < dialog->participant_words; w++) { // find the first zero bit, a word at a time
+        uint32_t slots = dialog->max_participants - w * 64;
+        uint64_t valid = slots >= 64 ? UINT64_MAX : ((uint64_t)1 << slots) - 1;
+        uint64_t free_slots = ~atomic_load(&dialog->slot_mask[w]) & valid;
+        if (free_slots == 0) continue;
+
+        int i = (int)w * 64 + __builtin_ctzll(free_slots);       // pick first free slot
+        uint64_t bit = free_slots & -free_slots;
+        dialog_cursors(dialog)[i].pid = pid;
+        atomic_store(&dialog_cursors(dialog)[i].read_seq, atomic_load(&dialog->tail_seq)); // start at the oldest kept message
+        post_control(dialog, CONTROL_JOIN, i, 0);
+        atomic_store(&dialog_cursors(dialog)[i].control_seq, atomic_load(&dialog->control_seq)); // events from now on
+        if (mode == SLOT_READER) atomic_fetch_or(&dialog->reader_mask[w], bit); // publish the slot only once its cursor is set
+        atomic_fetch_or(&dialog->slot_mask[w], bit);
+        dialog->dialog_participants++;
+        return i;                                                // caller stores this slot as its identity in the dialog
     }
-    fprintf(stderr, "Dialog %d is full.\n", dialog->dialog_id);
-    exit(ERROR_LIMIT_REACHED);
+    return -1;                                                   // no exit here: the caller holds the dialog_lock
 }
 
-void leave_dialog(shared_memory_t *shared_mem, dialog_t *dialog, int my_slot) {
-    if (dialog->slot_used[my_slot]) {                            // only change state if the slot was actually in use
-        dialog->slot_used[my_slot] = 0;
-        dialog->pids[my_slot] = 0;
+void leave_dialog(dialog_t *dialog, int my_slot) {
+    int w = my_slot / 64;
+    uint64_t bit = (uint64_t)1 << (my_slot % 64);
+    if (atomic_load(&dialog->slot_mask[w]) & bit) {              // only change state if the slot was actually in use
+        atomic_fetch_and(&dialog->reader_mask[w], ~bit);         // its cursor no longer holds back reclamation
+        atomic_fetch_and(&dialog->slot_mask[w], ~bit);
+        post_control(dialog, CONTROL_LEAVE, my_slot, 0);
+        dialog_cursors(dialog)[my_slot].pid = 0;
         if (dialog->dialog_participants > 0) dialog->dialog_participants--;
-        if (dialog->dialog_participants == 0) dialog->is_active = 0; // mark dialog reusable when empty
+        if (dialog->dialog_participants == 0) {
+            journal_close_dialog(dialog, my_slot);               // the ring may still hold unjournaled messages
+            dialog->is_active = 0;                               // mark dialog reusable when empty
+        }
     }
-    if (shared_mem->total_processes > 0) shared_mem->total_processes--;
 }
 
-void cleanup_if_last_process(shared_memory_t *shared_mem, int shm_id) {
-    if (shared_mem->total_processes != 0) return;                // only the last exiting process performs global cleanup
+void post_control(dialog_t *dialog, uint32_t kind, int slot, uint32_t hops) {
+    uint64_t n = atomic_load(&dialog->control_seq);
+    control_event_t *e = &dialog->control[n & (CONTROL_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);     // a reader still copying the old event drops it
+    atomic_thread_fence(memory_order_release);
+    e->kind = kind;
+    e->slot = slot;
+    e->pid = dialog_cursors(dialog)[slot].pid;
+    e->hops = hops;
+    e->data_seq = atomic_load(&dialog->write_seq);               // every message reserved so far comes before it
 
-    for (int i = 0; i < MAX_DIALOGS; i++) {
-        dialog_t *dialog = &shared_mem->dialogs[i];
-        if (dialog->sem_initialized) {
-            for (int s = 0; s < MAX_DIALOG_PARTICIPANTS; s++) {
-                sem_destroy(&dialog->slot_sem[s]);               // destroy unnamed semaphores stored inside shared memory
-            }
-            dialog->sem_initialized = 0;
+    if (kind == CONTROL_TERMINATE && atomic_load(&dialog->terminate_seq) == 0) {
+        dialog->terminate_slot = slot;
+        dialog->terminate_pid = e->pid;
+        atomic_store(&dialog->terminate_seq, e->data_seq + 1);
+    }
+    if (kind == CONTROL_PAUSE) atomic_store(&dialog->paused, 1);
+    if (kind == CONTROL_RESUME || kind == CONTROL_TERMINATE) atomic_store(&dialog->paused, 0); // the rest must still be read
+
+    atomic_store_explicit(&e->seq, n + 1, memory_order_release);
+    atomic_store_explicit(&dialog->control_seq, n + 1, memory_order_release);
+}
+
+void stop_reading(dialog_t *dialog, int my_slot) {
+    atomic_fetch_and(&dialog->reader_mask[my_slot / 64], ~((uint64_t)1 << (my_slot % 64))); // the next cleanup ignores our cursor
+}
+
+/*  Replaces the messages that the dead slot had reserved but not published with empty ones, so the
+    readers and the cleanup can move past them. Their payload blocks were only known to the dead
+    process and stay lost until the segment is removed.
+*/
+static void publish_abandoned(dialog_t *dialog, int slot) {
+    uint64_t from = atomic_load(&dialog_cursors(dialog)[slot].pending_seq);
+    uint32_t count = atomic_load(&dialog_cursors(dialog)[slot].pending_count);
+    for (uint64_t seq = from; seq < from + count; seq++) {
+        message_t *m = &dialog_messages(dialog)[seq & dialog->ring_mask];
+        if (atomic_load(&m->seq) == MSG_CELL_SEQ(seq)) continue; // it got as far as publishing this one
+        m->payload_off = 0;
+        m->payload_len = 0;                                      // empty, and for nobody: skipped by readers and the journal
+        m->sender_slot = (uint16_t)slot;
+        m->sender_pid = 0;
+        m->recipient_words = RECIPIENTS_NOBODY;
+        m->stream_id = 0;
+        atomic_store_explicit(&m->seq, MSG_CELL_SEQ(seq), memory_order_release);
+    }
+    atomic_store(&dialog_cursors(dialog)[slot].pending_count, 0);
+}
+
+int reap_dead_participants(dialog_t *dialog) {
+    // A participant that died while holding the dialog_lock may have left the count behind the mask.
+    int participants = 0;
+    for (uint32_t w = 0; w < dialog->participant_words; w++) {
+        participants += __builtin_popcountll(atomic_load(&dialog->slot_mask[w]));
+    }
+    dialog->dialog_participants = participants;
+
+    int reaped = 0;
+    for (uint32_t w = 0; w < dialog->participant_words; w++) {
+        uint64_t used = atomic_load(&dialog->slot_mask[w]);
+        while (used) {
+            int s = (int)w * 64 + __builtin_ctzll(used);
+            used &= used - 1;
+            if (!process_dead(dialog_cursors(dialog)[s].pid)) continue;
+
+            publish_abandoned(dialog, s);
+            int owner = s + 1;                                   // a cleanup it was running would never finish
+            atomic_compare_exchange_strong(&dialog->reclaiming, &owner, 0);
+            leave_dialog(dialog, s);
+            unregister_process(dialog_segment(dialog));          // it never got to do it itself
+            reaped++;
         }
     }
 
-    shared_mem->is_initialized = 0;
+    // A cleanup run by a process that died after leaving its slot (in journal_close_dialog).
+    int owner = atomic_load(&dialog->reclaiming);
+    if (owner > 0 && !slot_in(dialog->slot_mask, owner - 1)) {
+        atomic_compare_exchange_strong(&dialog->reclaiming, &owner, 0);
+    }
 
-    sem_close(mutex);                                            // close this process's handle to the named mutex
-    sem_unlink("/mutex");                                        // remove the named semaphore from the system
+    if (reaped > 0) stat_add(&dialog->stats.reaped, (uint64_t)reaped);
+    return reaped;
+}
+
+void reap_if_due(dialog_t *dialog) {
+    uint64_t now = monotonic_ns();
+    uint64_t due = atomic_load_explicit(&dialog->next_reap_ns, memory_order_relaxed);
+    if (now < due) return;
+    if (!atomic_compare_exchange_strong(&dialog->next_reap_ns, &due, now + REAP_INTERVAL_MS * 1000000ull)) return; // another sender does it
+
+    int rc = pthread_mutex_trylock(&dialog->dialog_lock);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(&dialog->dialog_lock);
+        stat_add(&dialog->stats.lock.recovered, 1);
+    }
+    else if (rc != 0) return;                                    // somebody is joining or leaving, and reaps then
+    stat_add(&dialog->stats.lock.acquired, 1);
+
+    reap_dead_participants(dialog);
+    pthread_mutex_unlock(&dialog->dialog_lock);
+}
+
+/*  Returns the number of processes attached to the segment. The kernel detaches processes that die,
+    so unlike total_processes this count can not be left behind by a crash.
+*/
+static int attached_processes(int shm_id) {
+    struct shmid_ds info;
+    if (shmctl(shm_id, IPC_STAT, &info) != 0) return -1;
+    return (int)info.shm_nattch;
+}
+
+int cleanup_if_last_process(shared_memory_t *shared_mem, int shm_id) {
+    // Only the last exiting process performs global cleanup. ./dialogstat attaches too, so while it
+    // watches, a crashed process that was never reaped keeps the segment alive.
+    if (atomic_load(&shared_mem->total_processes) != 0 && attached_processes(shm_id) != 1) return 0;
+
+    for (int i = 0; i < (int)shared_mem->max_dialogs; i++) {
+        if (!dialog_ready(shared_mem, i)) continue;              // never used, so never touched
+        pthread_mutex_destroy(&dialog_at(shared_mem, i)->dialog_lock); // nobody is left to use the dialog locks
+    }
+
+    // The global mutex itself is not destroyed: a process that attached just now may be waiting for it.
+    // It finds the segment removed and starts over (see attach_and_lock_shared_mem).
+    shared_mem->is_initialized = 0;
+    shared_mem->removed = 1;
+    shmctl(shm_id, IPC_RMID, NULL);                              // mark shared memory segment for removal
+    pthread_mutex_unlock(mutex);
 
     shmdt(shared_mem);                                           // detach mapping from this process
-    shmctl(shm_id, IPC_RMID, NULL);                               // mark shared memory segment for removal
+    return 1;
+}
+
+void detach_shared_memory(shared_memory_t *shared_mem, int shm_id) {
+    if (cleanup_if_last_process(shared_mem, shm_id)) return;
+    pthread_mutex_unlock(mutex);
+
+    shmdt(shared_mem);                                           // other processes still use the segment and the mutex
 }